@@ -0,0 +1,151 @@
+/*
+ * cachebench.c - cache hit throughput vs. thread count
+ *
+ * Prefills the cache with small objects, then has 1, 2, 4, ... threads
+ * look up random keys (every lookup hits) and reports hits per second.
+ * Each shard count runs in a forked child so it gets a fresh cache.
+ *
+ * usage: ./cachebench [-o objects] [-z objsize] [-n hits_per_thread]
+ *                     [-t maxthreads] [-s shards] [-P policy] [-C cache_mb]
+ */
+#include "csapp.h"
+#include "cache.h"
+#include "policy.h"
+#include <time.h>
+
+static int nobjects = 4096;
+static int objsize = 2048;
+static long nhits = 1000000;
+static const char *policy = "lru";
+static size_t cache_size = (size_t)256 << 20; /* big enough not to cap the shards */
+
+static void make_key(char *key, int i)
+{
+  sprintf(key, "bench.example.com/object/%d", i);
+}
+
+static void *hitter(void *vargp)
+{
+  unsigned int seed = (unsigned int)(long)vargp;
+  char key[64];
+  const char *buf;
+  int size;
+  long i;
+  cache_obj_t *obj;
+
+  for (i = 0; i < nhits; i++)
+  {
+    make_key(key, rand_r(&seed) % nobjects);
+    if ((obj = cache_get(key, &buf, &size)) == NULL)
+      app_error("cachebench: unexpected miss");
+    cache_release(obj);
+  }
+  return NULL;
+}
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* fill a fresh cache with nshards shards, then time each thread count */
+static void run(int nshards, int maxthreads)
+{
+  char key[64], *obj = Malloc(objsize);
+  pthread_t *tids = Malloc(maxthreads * sizeof(pthread_t));
+  double t0, elapsed, base = 0;
+  int i, t;
+
+  nshards = cache_init(cache_size, 1 << 20, nshards, policy);
+  memset(obj, 'x', objsize);
+  for (i = 0; i < nobjects; i++)
+  {
+    make_key(key, i);
+    cache_put(key, obj, objsize);
+  }
+
+  for (t = 1; t <= maxthreads; t *= 2)
+  {
+    t0 = now();
+    for (i = 0; i < t; i++)
+      Pthread_create(&tids[i], NULL, hitter, (void *)(long)(i + 1));
+    for (i = 0; i < t; i++)
+      Pthread_join(tids[i], NULL);
+    elapsed = now() - t0;
+
+    if (t == 1)
+      base = nhits / elapsed;
+    printf("%6d %7d %12.0f %8.2fx\n", nshards, t, t * nhits / elapsed,
+           (t * nhits / elapsed) / base);
+  }
+  fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+  int opt, maxthreads = 8, nshards = CACHE_DEFAULT_SHARDS;
+
+  while ((opt = getopt(argc, argv, "o:z:n:t:s:P:C:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'o':
+      nobjects = atoi(optarg);
+      break;
+    case 'z':
+      objsize = atoi(optarg);
+      break;
+    case 'n':
+      nhits = atol(optarg);
+      break;
+    case 't':
+      maxthreads = atoi(optarg);
+      break;
+    case 's':
+      nshards = atoi(optarg);
+      break;
+    case 'P':
+      policy = optarg;
+      break;
+    case 'C':
+      cache_size = (size_t)atol(optarg) << 20;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-o objects] [-z objsize] [-n hits_per_thread] "
+                      "[-t maxthreads] [-s shards] [-P policy] [-C cache_mb]\n",
+              argv[0]);
+      exit(1);
+    }
+  }
+  if (nobjects < 1 || objsize < 1 || objsize > (1 << 20) ||
+      (size_t)nobjects * objsize > cache_size / 2)
+    app_error("cachebench: working set must fit in half of the cache");
+
+  if (!policy_exists(policy))
+    app_error("cachebench: policy must be one of " POLICY_NAMES);
+
+  printf("%d objects x %d bytes, %ld hits per thread, %s\n", nobjects, objsize, nhits, policy);
+  printf("%6s %7s %12s %9s\n", "shards", "threads", "hits/s", "speedup");
+
+  /* the single global lock first, then the sharded cache */
+  fflush(stdout);
+  if (Fork() == 0)
+  {
+    run(1, maxthreads);
+    exit(0);
+  }
+  Wait(NULL);
+  if (nshards > 1)
+  {
+    if (Fork() == 0)
+    {
+      run(nshards, maxthreads);
+      exit(0);
+    }
+    Wait(NULL);
+  }
+  return 0;
+}
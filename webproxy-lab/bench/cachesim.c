@@ -0,0 +1,245 @@
+/*
+ * cachesim.c - hit ratio of each cache eviction policy on a trace
+ *
+ * Replays a request trace through the real cache (cache_get, and
+ * cache_put on a miss, as the proxy does) once per policy and reports
+ * the object and byte hit ratios. Each policy runs in a forked child
+ * so it gets a fresh cache.
+ *
+ * A trace file has one request per line, "key size", where size is the
+ * response's bytes; blank lines and lines starting with '#' are
+ * skipped. Without -f a synthetic trace is generated: keys drawn from
+ * a Zipf(alpha) distribution over a fixed population, interrupted
+ * every -i requests by a scan of -l keys that are never seen again,
+ * the pattern that flushes an LRU cache.
+ *
+ * The fill column is the response bytes cached at the end over the
+ * configured size: how much of the cache the arenas actually let the
+ * objects use (run with -z near -O to see large-object overhead).
+ *
+ * usage: ./cachesim [-f trace] [-k keys] [-z objsize] [-n requests]
+ *                   [-a alpha] [-i scan_interval] [-l scan_len]
+ *                   [-s shards] [-P policy] [-C cache_mb] [-O max_object_kb]
+ */
+#include "csapp.h"
+#include "cache.h"
+#include "policy.h"
+#include <math.h>
+#include <time.h>
+
+typedef struct
+{
+  char *key;
+  int size;
+} req_t;
+
+static req_t *reqs;
+static long nreqs, reqs_cap;
+
+static void add_req(const char *key, int size)
+{
+  if (nreqs == reqs_cap)
+  {
+    reqs_cap = reqs_cap ? 2 * reqs_cap : 65536;
+    reqs = Realloc(reqs, reqs_cap * sizeof(req_t));
+  }
+  reqs[nreqs].key = Malloc(strlen(key) + 1);
+  strcpy(reqs[nreqs].key, key);
+  reqs[nreqs].size = size;
+  nreqs++;
+}
+
+/* ---------- traces ---------- */
+static void load_trace(const char *path)
+{
+  char line[MAXLINE], key[MAXLINE];
+  FILE *fp = fopen(path, "r");
+  long lineno = 0;
+  int size;
+
+  if (fp == NULL)
+    unix_error("cachesim: open trace");
+  while (fgets(line, sizeof(line), fp))
+  {
+    lineno++;
+    if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+      continue;
+    if (sscanf(line, "%s %d", key, &size) != 2 || size < 0)
+    {
+      fprintf(stderr, "cachesim: %s:%ld: expected \"key size\"\n", path, lineno);
+      exit(1);
+    }
+    add_req(key, size);
+  }
+  fclose(fp);
+}
+
+/* Zipf over nkeys keys by inverting its CDF; scans use keys past nkeys */
+static void make_trace(int nkeys, int objsize, long n, double alpha, long interval, long scanlen)
+{
+  double *cdf = Malloc(nkeys * sizeof(double)), sum = 0, u;
+  unsigned int seed = 1;
+  long i, j, scankey = nkeys;
+  char key[64];
+  int lo, hi, mid;
+
+  for (i = 0; i < nkeys; i++)
+    cdf[i] = (sum += 1.0 / pow(i + 1, alpha));
+  for (i = 0; i < nkeys; i++)
+    cdf[i] /= sum;
+
+  for (i = 0; i < n; i++)
+  {
+    if (interval > 0 && i > 0 && i % interval == 0)
+      for (j = 0; j < scanlen && i < n; j++, i++)
+      {
+        sprintf(key, "sim.example.com/scan/%ld", scankey++);
+        add_req(key, objsize);
+      }
+    if (i == n)
+      break;
+    u = (double)rand_r(&seed) / RAND_MAX;
+    for (lo = 0, hi = nkeys - 1; lo < hi;)
+    {
+      mid = (lo + hi) / 2;
+      if (cdf[mid] < u)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    sprintf(key, "sim.example.com/object/%d", lo);
+    add_req(key, objsize);
+  }
+  Free(cdf);
+}
+
+/* ---------- replay ---------- */
+static void run(const char *policy, size_t cache_size, int max_object, int nshards, char *buf)
+{
+  long i, hits = 0;
+  double bytes = 0, hit_bytes = 0, t0;
+  size_t held_objects, held_bytes;
+  struct timespec ts;
+  const char *data;
+  cache_obj_t *obj;
+  int size;
+
+  cache_init(cache_size, max_object, nshards, policy);
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  t0 = ts.tv_sec + ts.tv_nsec / 1e9;
+  for (i = 0; i < nreqs; i++)
+  {
+    bytes += reqs[i].size;
+    if ((obj = cache_get(reqs[i].key, &data, &size)) != NULL)
+    {
+      hits++;
+      hit_bytes += size;
+      cache_release(obj);
+    }
+    else
+      cache_put(reqs[i].key, buf, reqs[i].size);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  cache_usage(&held_objects, &held_bytes);
+
+  printf("%-8s %10ld %8.2f%% %8.2f%% %10.2f %8.2f%%\n", policy, hits, 100.0 * hits / nreqs,
+         bytes ? 100.0 * hit_bytes / bytes : 0.0,
+         nreqs / (ts.tv_sec + ts.tv_nsec / 1e9 - t0) / 1e6, 100.0 * held_bytes / cache_size);
+}
+
+int main(int argc, char **argv)
+{
+  static const char *all[] = {"lru", "clock", "s3fifo", "tinylfu"};
+  const char *trace = NULL, *policy = NULL;
+  int opt, i, nkeys = 200000, objsize = 900, nshards = 1, maxsize = 0;
+  long n = 2000000, interval = 100000, scanlen = 50000;
+  size_t cache_size = (size_t)32 << 20; /* much smaller than the synthetic working set */
+  long max_object_kb = 1024;
+  double alpha = 0.8;
+  char *buf;
+
+  while ((opt = getopt(argc, argv, "f:k:z:n:a:i:l:s:P:C:O:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'f':
+      trace = optarg;
+      break;
+    case 'k':
+      nkeys = atoi(optarg);
+      break;
+    case 'z':
+      objsize = atoi(optarg);
+      break;
+    case 'n':
+      n = atol(optarg);
+      break;
+    case 'a':
+      alpha = atof(optarg);
+      break;
+    case 'i':
+      interval = atol(optarg);
+      break;
+    case 'l':
+      scanlen = atol(optarg);
+      break;
+    case 's':
+      nshards = atoi(optarg);
+      break;
+    case 'P':
+      policy = optarg;
+      break;
+    case 'C':
+      cache_size = (size_t)atol(optarg) << 20;
+      break;
+    case 'O':
+      max_object_kb = atol(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-f trace] [-k keys] [-z objsize] [-n requests] [-a alpha] "
+                      "[-i scan_interval] [-l scan_len] [-s shards] [-P policy] [-C cache_mb] "
+                      "[-O max_object_kb]\n",
+              argv[0]);
+      exit(1);
+    }
+  }
+  if (policy && !policy_exists(policy))
+    app_error("cachesim: policy must be one of " POLICY_NAMES);
+  if (nkeys < 1 || objsize < 0 || n < 1)
+    app_error("cachesim: keys and requests must be positive");
+  if (max_object_kb < 1 || max_object_kb > (CACHE_OBJECT_LIMIT >> 10))
+    app_error("cachesim: max_object_kb out of range");
+
+  if (trace)
+  {
+    load_trace(trace);
+    printf("%s: %ld requests, ", trace, nreqs);
+  }
+  else
+  {
+    make_trace(nkeys, objsize, n, alpha, interval, scanlen);
+    printf("zipf(%.2f) over %d keys x %d bytes, scans of %ld every %ld: %ld requests, ", alpha,
+           nkeys, objsize, scanlen, interval, nreqs);
+  }
+  for (i = 0; i < nreqs; i++)
+    if (reqs[i].size > maxsize)
+      maxsize = reqs[i].size;
+  buf = Calloc(maxsize + 1, 1);
+  printf("%zu KB cache, objects up to %ld KB\n", cache_size >> 10, max_object_kb);
+  printf("%-8s %10s %9s %9s %10s %9s\n", "policy", "hits", "hit", "byte hit", "Mreq/s", "fill");
+
+  /* every policy, or just -P, each in a fresh process */
+  for (i = 0; i < (int)(sizeof(all) / sizeof(all[0])); i++)
+  {
+    if (policy && strcmp(policy, all[i]))
+      continue;
+    fflush(stdout);
+    if (Fork() == 0)
+    {
+      run(all[i], cache_size, max_object_kb << 10, nshards, buf);
+      exit(0);
+    }
+    Wait(NULL);
+  }
+  return 0;
+}
@@ -0,0 +1,197 @@
+/*
+ * riobench.c - header-parsing throughput of rio_readlineb
+ *
+ * Writes a file of typical browser request headers, then reads it back
+ * line by line with the old byte-at-a-time rio_readlineb (kept here as
+ * bytewise_readlineb) and with the memchr-based one in csapp.c, and
+ * reports lines and megabytes per second for each. Beforehand, both
+ * readers must return exactly the same lines (NUL included); a mismatch
+ * aborts the run.
+ *
+ * usage: ./riobench [-n requests] [-r rounds] [-l maxlen]
+ */
+#include "csapp.h"
+#include <time.h>
+
+static const char *request =
+    "GET http://www.example.com/images/logo.png HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+    "Accept: image/avif,image/webp,*/*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Referer: http://www.example.com/index.html\r\n"
+    "Cookie: session=4f1c2a9b8e7d6c5b; theme=dark; lang=en\r\n"
+    "Connection: keep-alive\r\n"
+    "Proxy-Connection: keep-alive\r\n"
+    "\r\n";
+
+typedef ssize_t (*readline_t)(rio_t *rp, void *usrbuf, size_t maxlen);
+
+/* ---------- the previous implementation, for comparison ---------- */
+static ssize_t bytewise_read(rio_t *rp, char *usrbuf, size_t n)
+{
+  int cnt;
+
+  while (rp->rio_cnt <= 0)
+  {
+    rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
+    if (rp->rio_cnt < 0)
+    {
+      if (errno != EINTR)
+        return -1;
+    }
+    else if (rp->rio_cnt == 0)
+      return 0;
+    else
+      rp->rio_bufptr = rp->rio_buf;
+  }
+
+  cnt = n;
+  if (rp->rio_cnt < n)
+    cnt = rp->rio_cnt;
+  memcpy(usrbuf, rp->rio_bufptr, cnt);
+  rp->rio_bufptr += cnt;
+  rp->rio_cnt -= cnt;
+  return cnt;
+}
+
+static ssize_t bytewise_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
+{
+  int n, rc;
+  char c, *bufp = usrbuf;
+
+  for (n = 1; n < maxlen; n++)
+  {
+    if ((rc = bytewise_read(rp, &c, 1)) == 1)
+    {
+      *bufp++ = c;
+      if (c == '\n')
+      {
+        n++;
+        break;
+      }
+    }
+    else if (rc == 0)
+    {
+      if (n == 1)
+        return 0;
+      else
+        break;
+    }
+    else
+      return -1;
+  }
+  *bufp = 0;
+  return n - 1;
+}
+
+/* ---------- benchmark ---------- */
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* read path to EOF rounds times; returns seconds, sets lines and bytes */
+static double run(const char *path, readline_t readline, int rounds, size_t maxlen,
+                  long *lines, long *bytes)
+{
+  char *buf = Malloc(maxlen);
+  double t0, elapsed = 0;
+  rio_t rio;
+  ssize_t n;
+  int fd, r;
+
+  *lines = *bytes = 0;
+  for (r = 0; r < rounds; r++)
+  {
+    fd = Open(path, O_RDONLY, 0);
+    Rio_readinitb(&rio, fd);
+    t0 = now();
+    while ((n = readline(&rio, buf, maxlen)) > 0)
+    {
+      (*lines)++;
+      *bytes += n;
+    }
+    elapsed += now() - t0;
+    Close(fd);
+  }
+  Free(buf);
+  return elapsed;
+}
+
+/* read path with both readers side by side; every line must match */
+static void verify(const char *path, size_t maxlen)
+{
+  char *buf0 = Malloc(maxlen), *buf1 = Malloc(maxlen);
+  rio_t rio0, rio1;
+  ssize_t n0, n1;
+  int fd0 = Open(path, O_RDONLY, 0), fd1 = Open(path, O_RDONLY, 0);
+
+  Rio_readinitb(&rio0, fd0);
+  Rio_readinitb(&rio1, fd1);
+  do
+  {
+    n0 = bytewise_readlineb(&rio0, buf0, maxlen);
+    n1 = rio_readlineb(&rio1, buf1, maxlen);
+    if (n0 != n1 || (n0 > 0 && memcmp(buf0, buf1, n0 + 1)))
+      app_error("riobench: the two readers returned different lines");
+  } while (n0 > 0);
+  Close(fd0);
+  Close(fd1);
+  Free(buf0);
+  Free(buf1);
+}
+
+int main(int argc, char **argv)
+{
+  char path[] = "/tmp/riobenchXXXXXX";
+  int opt, fd, i, nrequests = 20000, rounds = 20;
+  size_t maxlen = MAXLINE, reqlen = strlen(request);
+  long lines[2], bytes[2];
+  double secs[2];
+
+  while ((opt = getopt(argc, argv, "n:r:l:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'n':
+      nrequests = atoi(optarg);
+      break;
+    case 'r':
+      rounds = atoi(optarg);
+      break;
+    case 'l':
+      maxlen = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-n requests] [-r rounds] [-l maxlen]\n", argv[0]);
+      exit(1);
+    }
+  }
+  if (nrequests < 1 || rounds < 1 || maxlen < 2)
+    app_error("riobench: need at least one request, one round and maxlen >= 2");
+
+  /* the page cache serves every round, so mostly the parsing is timed */
+  if ((fd = mkstemp(path)) < 0)
+    unix_error("riobench: mkstemp");
+  for (i = 0; i < nrequests; i++)
+    Rio_writen(fd, (void *)request, reqlen);
+  Close(fd);
+
+  verify(path, maxlen);
+  secs[0] = run(path, bytewise_readlineb, rounds, maxlen, &lines[0], &bytes[0]);
+  secs[1] = run(path, rio_readlineb, rounds, maxlen, &lines[1], &bytes[1]);
+  unlink(path);
+
+  printf("%d requests x %zu bytes, %d rounds, maxlen %zu\n", nrequests, reqlen, rounds, maxlen);
+  printf("%-10s %14s %10s %9s\n", "reader", "lines/s", "MB/s", "speedup");
+  printf("%-10s %14.0f %10.1f %8.2fx\n", "bytewise", lines[0] / secs[0],
+         bytes[0] / secs[0] / 1e6, 1.0);
+  printf("%-10s %14.0f %10.1f %8.2fx\n", "memchr", lines[1] / secs[1],
+         bytes[1] / secs[1] / 1e6, secs[0] / secs[1]);
+  return 0;
+}
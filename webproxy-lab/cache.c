@@ -0,0 +1,629 @@
+/*
+ * cache.c - thread-safe web object cache
+ *
+ * The cache is split into independently locked shards; an object's
+ * shard is picked from the high bits of the 64-bit FNV-1a hash of its
+ * key. Each shard has its own eviction policy instance (policy.c: LRU
+ * by default, or CLOCK, S3-FIFO or W-TinyLFU, chosen at startup), its
+ * own slice of the cache's size, and an open-addressing (linear probing)
+ * hash index on the low bits of the same hash, so lookup and eviction
+ * are O(1) and threads touching different shards never contend.
+ *
+ * Each shard's slice is a fixed arena (slab.c) reserved at startup. An
+ * object is one chunk of it, node, key and data together, so inserting
+ * and evicting never go to malloc, and the cache's memory never exceeds
+ * its size. Making room evicts the policy's victims until the
+ * arena can hand out a big enough chunk.
+ *
+ * Cached objects are immutable and reference counted. The cache holds
+ * one reference while an object is linked, and each hit takes another,
+ * so readers write straight from the shared buffer without copying it.
+ * An evicted or replaced object is freed when its last reader calls
+ * cache_release(); until then its chunk stays taken.
+ *
+ * Misses are coalesced ("single flight"): the first thread to miss on
+ * a key becomes its leader and fetches from the origin, while threads
+ * that miss on the same key meanwhile sleep on the flight and are
+ * handed the leader's object when it is inserted. If the leader gives
+ * up (error, or the object is too large to cache) the followers are
+ * released to fetch on their own.
+ *
+ * A response is captured for the cache while it streams to the client
+ * in a cache_fill_t, a single growing buffer that is copied into the
+ * arena on commit. The fill is dropped the moment it would exceed the
+ * per-object cap, so large transfers cost no memory.
+ *
+ * The total size, the per-object cap, the shard count and the policy
+ * are set once by cache_init; MAX_CACHE_SIZE and MAX_OBJECT_SIZE are
+ * only the defaults.
+ */
+#include "csapp.h"
+#include "cache.h"
+#include "policy.h"
+#include "slab.h"
+#include <stdint.h>
+
+#define CACHE_INDEX_MIN 64 /* initial slots per shard (power of two) */
+#define CACHE_MAX_SHARDS 256
+#define CACHE_FLIGHT_WAIT_SEC 30 /* followers stop waiting after this */
+
+/* ---------- cache data structures ---------- */
+/* a chunk of its shard's arena; uri and then data follow the object */
+struct cache_obj
+{
+  policy_node_t node; /* first, so a policy's victim is the object; hash is
+                         hash_str64(uri) and charge the arena bytes taken */
+  char *uri;          /* key */
+  char *data;         /* response bytes (never modified) */
+  int size;           /* total bytes in data */
+  int refcnt;         /* cache's own reference + readers; atomic */
+};
+
+enum
+{
+  FLIGHT_PENDING, /* leader still fetching */
+  FLIGHT_DONE,    /* obj inserted; waiters take a reference to it */
+  FLIGHT_FAILED   /* leader gave up; waiters fetch on their own */
+};
+
+/* one in-flight miss; protected by its shard's lock */
+struct cache_flight
+{
+  char *uri;
+  uint64_t hash;
+  int state;
+  cache_obj_t *obj;     /* FLIGHT_DONE: referenced until the last waiter leaves */
+  int waiters;          /* followers sleeping on cond */
+  pthread_cond_t cond;  /* signalled when state leaves FLIGHT_PENDING */
+  struct cache_flight *next;
+};
+
+typedef struct
+{
+  pthread_mutex_t lock;
+  policy_t *policy;  /* orders the linked objects for eviction */
+  size_t total_size; /* arena bytes held by linked objects */
+  size_t budget;     /* this shard's slice of cache_total_size */
+  slab_t *slab;      /* arena of budget bytes the objects live in */
+
+  /* hash index: NULL slot = empty; kept below 3/4 full */
+  cache_obj_t **index;
+  size_t index_cap; /* slots, power of two */
+  size_t count;     /* objects in this shard */
+
+  cache_flight_t *flights; /* misses currently being fetched */
+} __attribute__((aligned(64))) cache_shard_t; /* no false sharing */
+
+static cache_shard_t *cache_shards = NULL;
+static int cache_nshards = 0;
+static size_t cache_total_size = MAX_CACHE_SIZE; /* bytes over all shards */
+static int cache_max_object = MAX_OBJECT_SIZE;   /* largest object cached */
+
+/* ---------- function prototypes ---------- */
+static cache_shard_t *cache_shard_of(uint64_t hash);
+static cache_obj_t *cache_lookup(cache_shard_t *sh, const char *uri, uint64_t hash);
+static void cache_index_insert(cache_shard_t *sh, cache_obj_t *obj);
+static void cache_index_delete(cache_shard_t *sh, cache_obj_t *obj);
+static void cache_index_grow(cache_shard_t *sh);
+static void cache_unlink(cache_shard_t *sh, cache_obj_t *obj);
+static void cache_free_obj(cache_obj_t *obj);
+static cache_obj_t *cache_obj_new(cache_shard_t *sh, const char *uri, uint64_t hash,
+                                  const char *data, int size);
+static void cache_flight_finish(cache_flight_t *f, const char *data, int size);
+static void cache_insert(cache_shard_t *sh, cache_obj_t *obj);
+static cache_obj_t *cache_flight_wait(cache_shard_t *sh, cache_flight_t *f);
+static void cache_flight_end(cache_shard_t *sh, cache_flight_t *f, int state, cache_obj_t *obj);
+static void cache_flight_put(cache_flight_t *f);
+
+/* ---------- public interface ---------- */
+/*
+ * size the cache at total_size bytes holding objects of up to
+ * max_object bytes, split into nshards shards that each evict by the
+ * named policy (one of POLICY_NAMES). Every shard's arena must still
+ * have a chunk for a max_object object under the longest key, so
+ * nshards is capped at total_size over that chunk's size; nshards 0
+ * asks for CACHE_DEFAULT_SHARDS under the same cap. Returns the shard
+ * count in use, or -1 if the policy is unknown or max_object is out
+ * of range.
+ */
+int cache_init(size_t total_size, int max_object, int nshards, const char *policy)
+{
+  size_t limit;
+  int i;
+
+  if (!policy_exists(policy) || max_object < 1 || max_object > CACHE_OBJECT_LIMIT)
+    return -1;
+  cache_total_size = total_size;
+  cache_max_object = max_object;
+
+  limit = total_size / slab_chunk_size(sizeof(cache_obj_t) + CACHE_KEY_MAX + max_object);
+  if (limit > CACHE_MAX_SHARDS)
+    limit = CACHE_MAX_SHARDS;
+  if (nshards == 0)
+    nshards = CACHE_DEFAULT_SHARDS;
+  if ((size_t)nshards > limit)
+    nshards = limit;
+  if (nshards < 1)
+    nshards = 1;
+
+  cache_nshards = nshards;
+  cache_shards = Calloc(nshards, sizeof(cache_shard_t));
+  for (i = 0; i < nshards; i++)
+  {
+    cache_shard_t *sh = &cache_shards[i];
+    pthread_mutex_init(&sh->lock, NULL);
+    sh->total_size = 0;
+    /* budgets sum to exactly total_size */
+    sh->budget = total_size / nshards + (i == 0 ? total_size % nshards : 0);
+    sh->policy = policy_create(policy, sh->budget);
+    sh->slab = slab_create(sh->budget);
+    sh->index_cap = CACHE_INDEX_MIN;
+    sh->index = Calloc(sh->index_cap, sizeof(cache_obj_t *));
+    sh->count = 0;
+    sh->flights = NULL;
+  }
+  return nshards;
+}
+
+/*
+ * on a hit, return a reference to the object and point *buf_ptr and
+ * *size_ptr at its shared bytes; the caller must cache_release() it.
+ * return NULL on a miss.
+ */
+cache_obj_t *cache_get(const char *uri, const char **buf_ptr, int *size_ptr)
+{
+  uint64_t hash = hash_str64(uri); /* outside the lock */
+  cache_shard_t *sh = cache_shard_of(hash);
+  cache_obj_t *p;
+
+  pthread_mutex_lock(&sh->lock);
+  p = cache_lookup(sh, uri, hash);
+  policy_access(sh->policy, hash, p ? &p->node : NULL);
+  if (p == NULL)
+  {
+    pthread_mutex_unlock(&sh->lock);
+    return NULL;
+  }
+
+  /* hit: pin it for the caller */
+  __atomic_add_fetch(&p->refcnt, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&sh->lock);
+
+  *buf_ptr = p->data;
+  *size_ptr = p->size;
+  return p;
+}
+
+/* largest response the cache will take */
+int cache_max_object_size(void)
+{
+  return cache_max_object;
+}
+
+/* how many objects are linked, and how many response bytes they hold */
+void cache_usage(size_t *objects_ptr, size_t *bytes_ptr)
+{
+  size_t objects = 0, bytes = 0, i;
+  int s;
+
+  for (s = 0; s < cache_nshards; s++)
+  {
+    cache_shard_t *sh = &cache_shards[s];
+    pthread_mutex_lock(&sh->lock);
+    objects += sh->count;
+    for (i = 0; i < sh->index_cap; i++)
+      if (sh->index[i])
+        bytes += sh->index[i]->size;
+    pthread_mutex_unlock(&sh->lock);
+  }
+  *objects_ptr = objects;
+  *bytes_ptr = bytes;
+}
+
+/* drop a reference; the last one frees the object (no lock needed) */
+void cache_release(cache_obj_t *obj)
+{
+  if (__atomic_sub_fetch(&obj->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+    cache_free_obj(obj);
+}
+
+/* insert object into cache (evict as needed). copies uri and buf */
+void cache_put(const char *uri, const char *buf, int size)
+{
+  uint64_t hash;
+  cache_shard_t *sh;
+  cache_obj_t *obj;
+
+  if (size > cache_max_object)
+    return; /* don't cache oversize objects */
+
+  hash = hash_str64(uri);
+  sh = cache_shard_of(hash);
+  if ((obj = cache_obj_new(sh, uri, hash, buf, size)) == NULL)
+    return;
+
+  pthread_mutex_lock(&sh->lock);
+  cache_insert(sh, obj);
+  pthread_mutex_unlock(&sh->lock);
+}
+
+/* ---------- single-flight misses ---------- */
+/*
+ * Like cache_get, but coalesces concurrent misses on the same key.
+ * Returns a referenced object on a hit, including one that another
+ * thread's fetch produced while we waited. On a miss returns NULL, and
+ * *flight_ptr says what to do:
+ *   non-NULL: we lead; fetch from the origin, then call exactly one of
+ *             cache_flight_finish() or cache_flight_abandon()
+ *   NULL:     the leader gave up; fetch without coordination
+ */
+cache_obj_t *cache_get_or_lead(const char *uri, const char **buf_ptr, int *size_ptr,
+                               cache_flight_t **flight_ptr)
+{
+  uint64_t hash = hash_str64(uri);
+  cache_shard_t *sh = cache_shard_of(hash);
+  cache_obj_t *p;
+  cache_flight_t *f;
+
+  *flight_ptr = NULL;
+  pthread_mutex_lock(&sh->lock);
+  p = cache_lookup(sh, uri, hash);
+  policy_access(sh->policy, hash, p ? &p->node : NULL);
+  if (p != NULL)
+  {
+    __atomic_add_fetch(&p->refcnt, 1, __ATOMIC_RELAXED);
+  }
+  else
+  {
+    for (f = sh->flights; f; f = f->next)
+      if (f->hash == hash && strcmp(f->uri, uri) == 0)
+        break;
+
+    if (f)
+      p = cache_flight_wait(sh, f); /* follower */
+    else
+    {
+      /* leader: publish the flight so later misses wait on it */
+      f = Malloc(sizeof(cache_flight_t));
+      f->uri = Malloc(strlen(uri) + 1);
+      strcpy(f->uri, uri);
+      f->hash = hash;
+      f->state = FLIGHT_PENDING;
+      f->obj = NULL;
+      f->waiters = 0;
+      pthread_cond_init(&f->cond, NULL);
+      f->next = sh->flights;
+      sh->flights = f;
+      *flight_ptr = f;
+    }
+  }
+  pthread_mutex_unlock(&sh->lock);
+
+  if (p)
+  {
+    *buf_ptr = p->data;
+    *size_ptr = p->size;
+  }
+  return p;
+}
+
+/*
+ * leader: insert a copy of the fetched object and hand it to the
+ * followers, or let them fetch on their own if it found no room
+ */
+static void cache_flight_finish(cache_flight_t *f, const char *data, int size)
+{
+  cache_shard_t *sh = cache_shard_of(f->hash);
+  cache_obj_t *obj;
+
+  obj = cache_obj_new(sh, f->uri, f->hash, data, size);
+  pthread_mutex_lock(&sh->lock);
+  if (obj)
+    cache_insert(sh, obj);
+  cache_flight_end(sh, f, obj ? FLIGHT_DONE : FLIGHT_FAILED, obj);
+  pthread_mutex_unlock(&sh->lock);
+}
+
+/* leader: give up without an object; followers fetch on their own */
+void cache_flight_abandon(cache_flight_t *f)
+{
+  cache_shard_t *sh = cache_shard_of(f->hash);
+
+  pthread_mutex_lock(&sh->lock);
+  cache_flight_end(sh, f, FLIGHT_FAILED, NULL);
+  pthread_mutex_unlock(&sh->lock);
+}
+
+/* follower, shard lock held: sleep until the leader resolves f */
+static cache_obj_t *cache_flight_wait(cache_shard_t *sh, cache_flight_t *f)
+{
+  struct timespec deadline;
+  cache_obj_t *p = NULL;
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += CACHE_FLIGHT_WAIT_SEC;
+
+  f->waiters++;
+  while (f->state == FLIGHT_PENDING)
+    if (pthread_cond_timedwait(&f->cond, &sh->lock, &deadline) == ETIMEDOUT)
+      break; /* slow origin: fetch it ourselves */
+
+  if (f->state == FLIGHT_DONE)
+  {
+    p = f->obj;
+    __atomic_add_fetch(&p->refcnt, 1, __ATOMIC_RELAXED);
+  }
+  f->waiters--;
+  if (f->state != FLIGHT_PENDING && f->waiters == 0)
+    cache_flight_put(f);
+  return p;
+}
+
+/* shard lock held: resolve f, unlist it and wake the followers */
+static void cache_flight_end(cache_shard_t *sh, cache_flight_t *f, int state, cache_obj_t *obj)
+{
+  cache_flight_t **pp;
+
+  for (pp = &sh->flights; *pp != f; pp = &(*pp)->next)
+    ;
+  *pp = f->next;
+
+  f->state = state;
+  if (obj)
+  {
+    /* keep obj alive for the waiters even if it is evicted meanwhile */
+    __atomic_add_fetch(&obj->refcnt, 1, __ATOMIC_RELAXED);
+    f->obj = obj;
+  }
+  pthread_cond_broadcast(&f->cond);
+  if (f->waiters == 0)
+    cache_flight_put(f);
+}
+
+/* free a resolved flight nobody is waiting on */
+static void cache_flight_put(cache_flight_t *f)
+{
+  if (f->obj)
+    cache_release(f->obj);
+  pthread_cond_destroy(&f->cond);
+  Free(f->uri);
+  Free(f);
+}
+
+/* ---------- streaming fill ---------- */
+void cache_fill_init(cache_fill_t *fp)
+{
+  fp->buf = NULL;
+  fp->len = fp->cap = 0;
+  fp->ok = 1;
+}
+
+/* make room for n more bytes up front (e.g. from Content-length) */
+void cache_fill_reserve(cache_fill_t *fp, int n)
+{
+  if (!fp->ok)
+    return;
+  if (n > cache_max_object - fp->len)
+  {
+    cache_fill_abandon(fp);
+    return;
+  }
+  if (fp->len + n > fp->cap)
+  {
+    fp->cap = fp->len + n;
+    fp->buf = Realloc(fp->buf, fp->cap);
+  }
+}
+
+/* capture n more response bytes, or give up once they no longer fit */
+void cache_fill_append(cache_fill_t *fp, const char *p, int n)
+{
+  if (!fp->ok)
+    return;
+  if (n > cache_max_object - fp->len)
+  {
+    cache_fill_abandon(fp);
+    return;
+  }
+  if (fp->len + n > fp->cap)
+  {
+    fp->cap = fp->cap ? fp->cap : MAXBUF;
+    while (fp->len + n > fp->cap)
+      fp->cap *= 2;
+    if (fp->cap > cache_max_object)
+      fp->cap = cache_max_object;
+    fp->buf = Realloc(fp->buf, fp->cap);
+  }
+  memcpy(fp->buf + fp->len, p, n);
+  fp->len += n;
+}
+
+/* drop the captured copy; the fill stays unusable */
+void cache_fill_abandon(cache_fill_t *fp)
+{
+  if (fp->buf)
+    Free(fp->buf);
+  fp->buf = NULL;
+  fp->len = fp->cap = 0;
+  fp->ok = 0;
+}
+
+/*
+ * copy the captured response into the cache under uri, completing
+ * flight if we lead one, and drop the fill. Without a usable fill the
+ * flight is abandoned instead.
+ */
+void cache_fill_commit(cache_fill_t *fp, const char *uri, cache_flight_t *flight)
+{
+  if (!fp->ok || fp->len == 0)
+  {
+    cache_fill_abandon(fp);
+    if (flight)
+      cache_flight_abandon(flight);
+    return;
+  }
+
+  if (flight)
+    cache_flight_finish(flight, fp->buf, fp->len);
+  else
+    cache_put(uri, fp->buf, fp->len);
+  cache_fill_abandon(fp);
+}
+
+/* ---------- hash index ---------- */
+/* high bits pick the shard; the index probes from the low bits */
+static cache_shard_t *cache_shard_of(uint64_t hash)
+{
+  return &cache_shards[(hash >> 32) % cache_nshards];
+}
+
+static cache_obj_t *cache_lookup(cache_shard_t *sh, const char *uri, uint64_t hash)
+{
+  size_t mask = sh->index_cap - 1;
+  size_t i = hash & mask;
+  cache_obj_t *p;
+
+  while ((p = sh->index[i]) != NULL)
+  {
+    if (p->node.hash == hash && strcmp(p->uri, uri) == 0)
+      return p;
+    i = (i + 1) & mask;
+  }
+  return NULL;
+}
+
+static void cache_index_insert(cache_shard_t *sh, cache_obj_t *obj)
+{
+  size_t mask, i;
+
+  if ((sh->count + 1) * 4 > sh->index_cap * 3)
+    cache_index_grow(sh);
+
+  mask = sh->index_cap - 1;
+  i = obj->node.hash & mask;
+  while (sh->index[i] != NULL)
+    i = (i + 1) & mask;
+  sh->index[i] = obj;
+  sh->count++;
+}
+
+/* remove obj with backward-shift deletion, so no tombstones are needed */
+static void cache_index_delete(cache_shard_t *sh, cache_obj_t *obj)
+{
+  size_t mask = sh->index_cap - 1;
+  size_t i = obj->node.hash & mask, j, home;
+
+  while (sh->index[i] != obj)
+    i = (i + 1) & mask;
+
+  /* pull later entries of the probe run into the hole when allowed */
+  j = i;
+  while (1)
+  {
+    sh->index[i] = NULL;
+    do
+    {
+      j = (j + 1) & mask;
+      if (sh->index[j] == NULL)
+      {
+        sh->count--;
+        return;
+      }
+      home = sh->index[j]->node.hash & mask;
+      /* keep j where it is if its home lies cyclically in (i, j] */
+    } while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+    sh->index[i] = sh->index[j];
+    i = j;
+  }
+}
+
+static void cache_index_grow(cache_shard_t *sh)
+{
+  cache_obj_t **old = sh->index;
+  size_t oldcap = sh->index_cap, i, j, mask;
+
+  sh->index_cap *= 2;
+  sh->index = Calloc(sh->index_cap, sizeof(cache_obj_t *));
+  mask = sh->index_cap - 1;
+  for (i = 0; i < oldcap; i++)
+  {
+    if (old[i] == NULL)
+      continue;
+    j = old[i]->node.hash & mask;
+    while (sh->index[j] != NULL)
+      j = (j + 1) & mask;
+    sh->index[j] = old[i];
+  }
+  Free(old);
+}
+
+/* ---------- objects ---------- */
+/* remove obj from the policy and the index and uncharge its size (does not free) */
+static void cache_unlink(cache_shard_t *sh, cache_obj_t *obj)
+{
+  policy_remove(sh->policy, &obj->node);
+  cache_index_delete(sh, obj);
+  sh->total_size -= obj->node.charge;
+}
+
+/* return the chunk to its arena once the last reference is gone */
+static void cache_free_obj(cache_obj_t *obj)
+{
+  if (!obj)
+    return;
+  slab_free(cache_shard_of(obj->node.hash)->slab, obj);
+}
+
+/*
+ * Carve an unlinked node holding copies of uri and data out of sh's
+ * arena, evicting the policy's victims until a chunk is free. Returns NULL if
+ * none comes free: the object is bigger than any chunk, or evicted
+ * objects still being read hold the space. Takes the shard lock only
+ * for the allocation; the copying happens outside it.
+ */
+static cache_obj_t *cache_obj_new(cache_shard_t *sh, const char *uri, uint64_t hash,
+                                  const char *data, int size)
+{
+  size_t urilen = strlen(uri) + 1, bytes = sizeof(cache_obj_t) + urilen + size;
+  policy_node_t *victim;
+  cache_obj_t *obj;
+
+  if (bytes > slab_largest(sh->slab))
+    return NULL;
+  pthread_mutex_lock(&sh->lock);
+  while ((obj = slab_alloc(sh->slab, bytes)) == NULL &&
+         (victim = policy_victim(sh->policy)) != NULL)
+  {
+    cache_unlink(sh, (cache_obj_t *)victim);
+    cache_release((cache_obj_t *)victim); /* readers may still hold it */
+  }
+  pthread_mutex_unlock(&sh->lock);
+  if (obj == NULL)
+    return NULL;
+
+  obj->uri = (char *)(obj + 1);
+  memcpy(obj->uri, uri, urilen);
+  obj->node.hash = hash;
+  obj->data = obj->uri + urilen;
+  memcpy(obj->data, data, size);
+  obj->size = size;
+  obj->node.charge = slab_chunk_size(bytes);
+  obj->refcnt = 1; /* the cache's reference */
+  return obj;
+}
+
+/* shard lock held: link obj (from cache_obj_new), replacing any copy */
+static void cache_insert(cache_shard_t *sh, cache_obj_t *obj)
+{
+  cache_obj_t *old;
+
+  if ((old = cache_lookup(sh, obj->uri, obj->node.hash)) != NULL)
+  {
+    cache_unlink(sh, old);
+    cache_release(old);
+  }
+
+  policy_insert(sh->policy, &obj->node);
+  sh->total_size += obj->node.charge;
+  cache_index_insert(sh, obj);
+}
@@ -0,0 +1,50 @@
+/* cache.h - thread-safe web object cache shared by the proxy engines */
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stddef.h>
+
+/* defaults for cache_init's sizes (the proxy's -C and -O) */
+#ifndef MAX_CACHE_SIZE
+#define MAX_CACHE_SIZE 1049000
+#endif
+#ifndef MAX_OBJECT_SIZE
+#define MAX_OBJECT_SIZE 512000
+#endif
+
+#define CACHE_OBJECT_LIMIT (1 << 30) /* largest per-object cap cache_init accepts */
+#define CACHE_DEFAULT_SHARDS 16 /* nshards 0: this many, or as many as fit */
+#define CACHE_KEY_MAX (NI_MAXHOST + MAXLINE) /* longest key (host + path) the sizing allows for */
+
+typedef struct cache_obj cache_obj_t;
+typedef struct cache_flight cache_flight_t;
+
+/* shard count in use (nshards 0: auto), -1 if policy is unknown or max_object out of range */
+int cache_init(size_t total_size, int max_object, int nshards, const char *policy);
+int cache_max_object_size(void);
+void cache_usage(size_t *objects_ptr, size_t *bytes_ptr); /* linked objects, their data bytes */
+cache_obj_t *cache_get(const char *uri, const char **buf_ptr, int *size_ptr);
+void cache_release(cache_obj_t *obj);
+void cache_put(const char *uri, const char *buf, int size);
+
+/* single-flight: coalesce concurrent misses on one key (see cache.c) */
+cache_obj_t *cache_get_or_lead(const char *uri, const char **buf_ptr, int *size_ptr,
+                               cache_flight_t **flight_ptr);
+void cache_flight_abandon(cache_flight_t *f);
+
+/* a response captured while it streams; the cache copies buf on commit */
+typedef struct
+{
+  char *buf; /* malloc'd, grows up to cache_max_object_size() */
+  int len;
+  int cap;
+  int ok; /* cleared once the response can no longer be cached */
+} cache_fill_t;
+
+void cache_fill_init(cache_fill_t *fp);
+void cache_fill_reserve(cache_fill_t *fp, int n);
+void cache_fill_append(cache_fill_t *fp, const char *p, int n);
+void cache_fill_abandon(cache_fill_t *fp);
+void cache_fill_commit(cache_fill_t *fp, const char *uri, cache_flight_t *flight);
+
+#endif /* __CACHE_H__ */
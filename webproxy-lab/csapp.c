@@ -1,6 +1,22 @@
 /*
  * csapp.c - Functions for the CS:APP3e book
  *
+ * Updated for the proxy:
+ *   - Added open_listenfd_reuseport for per-core accept loops
+ *   - Split the connect loop of open_clientfd into open_clientfd_ai so
+ *     callers with their own (cached) address lists can reuse it
+ *   - open_clientfd_ai connects without blocking, racing the addresses
+ *     (happy eyeballs) under an optional deadline
+ *   - gai_error is renamed to csapp_gai_error (see csapp.h) so that
+ *     _GNU_SOURCE code can include this header
+ *   - rio_readlineb copies whole spans found with memchr rather than
+ *     reading one byte at a time
+ *   - Added rio_writev, Rio_writev and the rio_iov_t gather list, so
+ *     headers and bodies go out in one writev without being copied
+ *     together first
+ *   - Added hash_str32, hash_str64 and mono_sec, shared by the proxy's
+ *     hash tables and timers
+ *
  * Updated 10/2016 reb:
  *   - Fixed bug in sio_ltoa that didn't cover negative numbers
  *
@@ -805,6 +821,82 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 }
 /* $end rio_writen */
 
+/*
+ * rio_writev - Robustly write a gather list (unbuffered), resuming
+ *     after partial writes. The iovec array is used up in the process.
+ */
+/* $begin rio_writev */
+ssize_t rio_writev(int fd, struct iovec *iov, int iovcnt)
+{
+    size_t n = 0;
+    ssize_t nwritten;
+    int i;
+
+    for (i = 0; i < iovcnt; i++)
+        n += iov[i].iov_len;
+    while (1)
+    {
+        while (iovcnt > 0 && iov->iov_len == 0) /* Skip finished pieces */
+        {
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt <= 0)
+            break;
+        if ((nwritten = writev(fd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX)) < 0)
+        {
+            if (errno == EINTR) /* Interrupted by sig handler return */
+                nwritten = 0;   /* and call writev() again */
+            else
+                return -1; /* errno set by writev() */
+        }
+        else if (nwritten == 0) /* No progress on a nonempty list: give up */
+        {
+            errno = EIO;
+            return -1;
+        }
+        for (; iovcnt > 0 && (size_t)nwritten >= iov->iov_len; iov++, iovcnt--)
+            nwritten -= iov->iov_len;
+        if (nwritten > 0) /* Partly written piece */
+        {
+            iov->iov_base = (char *)iov->iov_base + nwritten;
+            iov->iov_len -= nwritten;
+        }
+    }
+    return n;
+}
+/* $end rio_writev */
+
+/*
+ * rio_iovinit - Start an empty gather list
+ */
+void rio_iovinit(rio_iov_t *vp)
+{
+    vp->iov_cnt = 0;
+    vp->iov_len = 0;
+}
+
+/*
+ * rio_iovadd - Append n bytes at p, which must stay put until the list
+ *     is written. Returns -1 if the list is full.
+ */
+int rio_iovadd(rio_iov_t *vp, const void *p, size_t n)
+{
+    if (n == 0)
+        return 0;
+    if (vp->iov_cnt == RIO_IOVMAX)
+        return -1;
+    vp->iov[vp->iov_cnt].iov_base = (void *)p;
+    vp->iov[vp->iov_cnt++].iov_len = n;
+    vp->iov_len += n;
+    return 0;
+}
+
+int rio_iovputs(rio_iov_t *vp, const char *s)
+{
+    return rio_iovadd(vp, s, strlen(s));
+}
+
 /*
  * rio_read - This is a wrapper for the Unix read() function that
  *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
@@ -881,36 +973,46 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 
 /*
  * rio_readlineb - Robustly read a text line (buffered)
+ *    Scans the internal buffer with memchr() and copies whole spans
+ *    up to the newline, instead of one rio_read() call per byte.
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
+    size_t n = 0, cnt;
+    ssize_t rc;
+    char *bufp = usrbuf, *nl;
 
-    for (n = 1; n < maxlen; n++)
+    while (n + 1 < maxlen)
     {
-        if ((rc = rio_read(rp, &c, 1)) == 1)
-        {
-            *bufp++ = c;
-            if (c == '\n')
-            {
-                n++;
+        if (rp->rio_cnt <= 0)
+        { /* Refill; rio_read hands back the first byte */
+            if ((rc = rio_read(rp, bufp, 1)) < 0)
+                return -1; /* Error */
+            else if (rc == 0)
+                break; /* EOF */
+            n++;
+            if (*bufp++ == '\n')
                 break;
-            }
+            continue;
         }
-        else if (rc == 0)
-        {
-            if (n == 1)
-                return 0; /* EOF, no data read */
-            else
-                break; /* EOF, some data was read */
-        }
-        else
-            return -1; /* Error */
+
+        /* Copy the buffered bytes up to and including the newline */
+        cnt = maxlen - 1 - n;
+        if ((size_t)rp->rio_cnt < cnt)
+            cnt = rp->rio_cnt;
+        if ((nl = memchr(rp->rio_bufptr, '\n', cnt)) != NULL)
+            cnt = nl - rp->rio_bufptr + 1;
+        memcpy(bufp, rp->rio_bufptr, cnt);
+        rp->rio_bufptr += cnt;
+        rp->rio_cnt -= cnt;
+        bufp += cnt;
+        n += cnt;
+        if (nl)
+            break;
     }
     *bufp = 0;
-    return n - 1;
+    return n; /* 0 only at EOF with no data read */
 }
 /* $end rio_readlineb */
 
@@ -932,6 +1034,12 @@ void Rio_writen(int fd, void *usrbuf, size_t n)
         unix_error("Rio_writen error");
 }
 
+void Rio_writev(int fd, struct iovec *iov, int iovcnt)
+{
+    if (rio_writev(fd, iov, iovcnt) < 0)
+        unix_error("Rio_writev error");
+}
+
 void Rio_readinitb(rio_t *rp, int fd)
 {
     rio_readinitb(rp, fd);
@@ -971,7 +1079,7 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
 int open_clientfd(char *hostname, char *port)
 {
     int clientfd, rc;
-    struct addrinfo hints, *listp, *p;
+    struct addrinfo hints, *listp;
 
     /* Get a list of potential server addresses */
     memset(&hints, 0, sizeof(struct addrinfo));
@@ -985,30 +1093,155 @@ int open_clientfd(char *hostname, char *port)
     }
 
     /* Walk the list for one that we can successfully connect to */
+    clientfd = open_clientfd_ai(listp, -1);
+
+    /* Clean up */
+    freeaddrinfo(listp);
+    return clientfd;
+}
+/* $end open_clientfd */
+
+/*
+ * open_clientfd_ai - Connect to one of the addresses in listp and
+ *     return a socket descriptor, or -1 with errno set if every address
+ *     failed or timeout_ms (negative: no limit) ran out. listp is left
+ *     to the caller.
+ *
+ *     Addresses are raced happy-eyeballs style (RFC 8305): families
+ *     alternate, starting with the resolver's first choice, and the next
+ *     attempt starts as soon as the previous one fails or after
+ *     CONNECT_ATTEMPT_DELAY ms without an answer, while the earlier ones
+ *     keep going. The first connection to complete wins, so one
+ *     unreachable address no longer costs a full SYN timeout.
+ */
+#define CONNECT_ATTEMPT_DELAY 250 /* ms */
+#define CONNECT_MAX_ATTEMPTS 16
+
+static long connect_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/* interleave address families, starting with the first one listed */
+static int connect_order(struct addrinfo *listp, struct addrinfo **cand)
+{
+    struct addrinfo *p, *first[CONNECT_MAX_ATTEMPTS], *other[CONNECT_MAX_ATTEMPTS];
+    int i, n = 0, nfirst = 0, nother = 0;
+
     for (p = listp; p; p = p->ai_next)
     {
-        /* Create a socket descriptor */
-        if ((clientfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
-            continue; /* Socket failed, try the next */
+        if (p->ai_family == listp->ai_family && nfirst < CONNECT_MAX_ATTEMPTS)
+            first[nfirst++] = p;
+        else if (p->ai_family != listp->ai_family && nother < CONNECT_MAX_ATTEMPTS)
+            other[nother++] = p;
+    }
+    for (i = 0; n < CONNECT_MAX_ATTEMPTS && (i < nfirst || i < nother); i++)
+    {
+        if (i < nfirst)
+            cand[n++] = first[i];
+        if (i < nother && n < CONNECT_MAX_ATTEMPTS)
+            cand[n++] = other[i];
+    }
+    return n;
+}
 
-        /* Connect to the server */
-        if (connect(clientfd, p->ai_addr, p->ai_addrlen) != -1)
-            break; /* Success */
-        if (close(clientfd) < 0)
-        { /* Connect failed, try another */ // line:netp:openclientfd:closefd
-            fprintf(stderr, "open_clientfd: close failed: %s\n", strerror(errno));
-            return -1;
+int open_clientfd_ai(struct addrinfo *listp, int timeout_ms)
+{
+    struct addrinfo *cand[CONNECT_MAX_ATTEMPTS], *p;
+    struct pollfd pfd[CONNECT_MAX_ATTEMPTS];
+    int ncand, next = 0, npend = 0, i, fd, err, wait_ms, clientfd = -1;
+    int last_err = ECONNREFUSED;
+    long now = connect_now_ms(), next_start = now;
+    long deadline = (timeout_ms < 0) ? -1 : now + timeout_ms;
+    socklen_t len;
+
+    ncand = connect_order(listp, cand);
+    while (clientfd < 0 && (next < ncand || npend > 0))
+    {
+        now = connect_now_ms();
+        if (deadline >= 0 && now >= deadline)
+        {
+            last_err = ETIMEDOUT;
+            break;
+        }
+
+        /* Start the next attempt once it is due */
+        if (next < ncand && (npend == 0 || now >= next_start))
+        {
+            p = cand[next++];
+            if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+            {
+                last_err = errno;
+                continue; /* Socket failed, try the next */
+            }
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+            if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+            {
+                clientfd = fd; /* e.g. loopback may connect at once */
+                break;
+            }
+            if (errno != EINPROGRESS)
+            {
+                last_err = errno;
+                close(fd);
+                continue;
+            }
+            pfd[npend].fd = fd;
+            pfd[npend].events = POLLOUT;
+            npend++;
+            next_start = now + CONNECT_ATTEMPT_DELAY;
+            continue;
+        }
+
+        /* Wait for an attempt to finish, the next start, or the deadline */
+        wait_ms = (next < ncand) ? next_start - now : -1;
+        if (deadline >= 0 && (wait_ms < 0 || deadline - now < wait_ms))
+            wait_ms = deadline - now;
+        if (poll(pfd, npend, wait_ms) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            last_err = errno;
+            break;
+        }
+        for (i = 0; i < npend;)
+        {
+            if (pfd[i].revents == 0)
+            {
+                i++;
+                continue;
+            }
+            err = 0;
+            len = sizeof(err);
+            if (getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+                err = errno;
+            if (err == 0)
+            {
+                clientfd = pfd[i].fd; /* Success */
+                pfd[i] = pfd[--npend];
+                break;
+            }
+            last_err = err; /* Refused: start the next one right away */
+            close(pfd[i].fd);
+            pfd[i] = pfd[--npend];
+            next_start = now;
         }
     }
 
-    /* Clean up */
-    freeaddrinfo(listp);
-    if (!p) /* All connects failed */
+    /* Drop the attempts that lost (or all of them on failure) */
+    for (i = 0; i < npend; i++)
+        close(pfd[i].fd);
+    if (clientfd < 0)
+    {
+        errno = last_err;
         return -1;
-    else /* The last connect succeeded */
-        return clientfd;
+    }
+    fcntl(clientfd, F_SETFL, fcntl(clientfd, F_GETFL, 0) & ~O_NONBLOCK);
+    return clientfd;
 }
-/* $end open_clientfd */
 
 /*
  * open_listenfd - Open and return a listening socket on port. This
@@ -1018,8 +1251,26 @@ int open_clientfd(char *hostname, char *port)
  *       -2 for getaddrinfo error
  *       -1 with errno set for other errors.
  */
+static int open_listenfd_common(char *port, int reuseport);
+
 /* $begin open_listenfd */
 int open_listenfd(char *port)
+{
+    return open_listenfd_common(port, 0);
+}
+/* $end open_listenfd */
+
+/*
+ * open_listenfd_reuseport - Like open_listenfd, but sets SO_REUSEPORT
+ *     so that several listening sockets can bind the same port. The
+ *     kernel then spreads incoming connections across them.
+ */
+int open_listenfd_reuseport(char *port)
+{
+    return open_listenfd_common(port, 1);
+}
+
+static int open_listenfd_common(char *port, int reuseport)
 {
     struct addrinfo hints, *listp, *p;
     int listenfd, rc, optval = 1;
@@ -1046,6 +1297,15 @@ int open_listenfd(char *port)
         setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, // line:netp:csapp:setsockopt
                    (const void *)&optval, sizeof(int));
 
+        /* Share the port with the other accept loops */
+        if (reuseport &&
+            setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                       (const void *)&optval, sizeof(int)) < 0)
+        {
+            close(listenfd);
+            continue;
+        }
+
         /* Bind the descriptor to the address */
         if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
             break; /* Success */
@@ -1069,7 +1329,6 @@ int open_listenfd(char *port)
     }
     return listenfd;
 }
-/* $end open_listenfd */
 
 /****************************************************
  * Wrappers for reentrant protocol-independent helpers
@@ -1092,4 +1351,51 @@ int Open_listenfd(char *port)
     return rc;
 }
 
+int Open_listenfd_reuseport(char *port)
+{
+    int rc;
+
+    if ((rc = open_listenfd_reuseport(port)) < 0)
+        unix_error("Open_listenfd_reuseport error");
+    return rc;
+}
+
+/****************************************
+ * Hashing and clock helpers
+ ****************************************/
+/* FNV-1a, 32-bit */
+unsigned hash_str32(const char *s)
+{
+    unsigned h = 2166136261u;
+
+    while (*s)
+    {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* FNV-1a, 64-bit */
+uint64_t hash_str64(const char *s)
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    while (*s)
+    {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* seconds on a clock that never jumps, for timeouts and lifetimes */
+time_t mono_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
 /* $end csapp.c */
@@ -0,0 +1,228 @@
+/*
+ * dns.c - thread-safe cache of origin name lookups
+ *
+ * getaddrinfo() is synchronous and can take as long as the slowest
+ * name server, so its results are cached per host:port. A successful
+ * lookup is reused for DNS_TTL seconds and a failed one is remembered
+ * for DNS_NEG_TTL, so a dead name does not cost a resolver round trip
+ * on every request. (getaddrinfo does not report record TTLs, hence the
+ * fixed lifetimes.)
+ *
+ * Entries are immutable and reference counted like cache objects: a
+ * caller walks the address list without holding the lock, and an entry
+ * replaced meanwhile is freed when its last user releases it.
+ *
+ * With refresh enabled, a hit in the last quarter of an entry's life
+ * queues the name for a background thread, which resolves it again and
+ * swaps in the new entry, so names in steady use never expire on the
+ * request path. A failed refresh keeps serving the old entry until it
+ * expires, and the entry is not queued again for DNS_REFRESH_RETRY
+ * seconds, so a dead resolver costs one attempt per interval rather
+ * than one per hit.
+ */
+#include "csapp.h"
+#include "dns.h"
+#include <time.h>
+
+#define DNS_BUCKETS 256
+
+struct dns_entry
+{
+  char *key;                   /* "host:port" */
+  struct addrinfo *list;       /* NULL: negative entry */
+  time_t expires;
+  int refcnt;                  /* the table's reference plus one per user */
+  int refreshing;              /* queued for or in background refresh */
+  time_t refresh_after;        /* no new refresh queued before this */
+  struct dns_entry *next;      /* bucket chain */
+  struct dns_entry *next_todo; /* refresh queue */
+};
+
+static dns_entry_t *table[DNS_BUCKETS];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t todo_cond = PTHREAD_COND_INITIALIZER;
+static dns_entry_t *todo; /* entries waiting for a refresh (each holds a ref) */
+static int refresh_on;
+
+static dns_entry_t **dns_find(const char *key);
+static dns_entry_t *dns_resolve(const char *key, const char *host, const char *port);
+static void dns_install(dns_entry_t *e);
+static void *dns_refresher(void *vargp);
+
+/* ---------- public interface ---------- */
+void dns_init(int refresh)
+{
+  pthread_t tid;
+
+  refresh_on = refresh;
+  if (refresh)
+  {
+    Pthread_create(&tid, NULL, dns_refresher, NULL);
+    Pthread_detach(tid);
+  }
+}
+
+/*
+ * Resolve host:port, from the cache when possible. On success sets
+ * *list_ptr and returns a reference the caller must dns_release()
+ * once done with the list; returns NULL if the name does not resolve.
+ */
+dns_entry_t *dns_lookup(const char *host, const char *port, struct addrinfo **list_ptr)
+{
+  char key[MAXLINE];
+  dns_entry_t *e;
+  time_t now = mono_sec();
+
+  snprintf(key, sizeof(key), "%s:%s", host, port);
+  pthread_mutex_lock(&lock);
+  e = *dns_find(key);
+  if (e && now < e->expires)
+  {
+    __atomic_add_fetch(&e->refcnt, 1, __ATOMIC_RELAXED);
+    if (refresh_on && e->list && !e->refreshing && now >= e->expires - DNS_TTL / 4 &&
+        now >= e->refresh_after)
+    {
+      e->refreshing = 1;
+      e->refresh_after = now + DNS_REFRESH_RETRY;
+      __atomic_add_fetch(&e->refcnt, 1, __ATOMIC_RELAXED);
+      e->next_todo = todo;
+      todo = e;
+      pthread_cond_signal(&todo_cond);
+    }
+    pthread_mutex_unlock(&lock);
+  }
+  else
+  {
+    /* miss or expired: resolve without the lock (concurrent misses may race; last one wins) */
+    pthread_mutex_unlock(&lock);
+    e = dns_resolve(key, host, port);
+    pthread_mutex_lock(&lock);
+    dns_install(e);
+    pthread_mutex_unlock(&lock);
+  }
+
+  if (e->list == NULL)
+  {
+    dns_release(e);
+    return NULL;
+  }
+  *list_ptr = e->list;
+  return e;
+}
+
+void dns_release(dns_entry_t *e)
+{
+  if (__atomic_sub_fetch(&e->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+  {
+    if (e->list)
+      freeaddrinfo(e->list);
+    Free(e->key);
+    Free(e);
+  }
+}
+
+/* open_clientfd, resolving through the cache; timeout_ms bounds the connect */
+int dns_open_clientfd(const char *host, const char *port, int timeout_ms)
+{
+  struct addrinfo *list;
+  dns_entry_t *e;
+  int fd;
+
+  if ((e = dns_lookup(host, port, &list)) == NULL)
+    return -2;
+  fd = open_clientfd_ai(list, timeout_ms);
+  dns_release(e);
+  return fd;
+}
+
+/* ---------- helpers ---------- */
+/* link that points at key's entry, or at the NULL ending its chain (lock held) */
+static dns_entry_t **dns_find(const char *key)
+{
+  dns_entry_t **pp = &table[hash_str32(key) % DNS_BUCKETS];
+
+  while (*pp && strcmp((*pp)->key, key))
+    pp = &(*pp)->next;
+  return pp;
+}
+
+/* run getaddrinfo and wrap the result (failures too) in a new entry with one ref */
+static dns_entry_t *dns_resolve(const char *key, const char *host, const char *port)
+{
+  struct addrinfo hints;
+  dns_entry_t *e = Calloc(1, sizeof(dns_entry_t));
+  int rc;
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+  if ((rc = getaddrinfo(host, port, &hints, &e->list)) != 0)
+  {
+    fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n", host, port, gai_strerror(rc));
+    e->list = NULL;
+  }
+
+  e->key = Malloc(strlen(key) + 1);
+  strcpy(e->key, key);
+  e->expires = mono_sec() + (e->list ? DNS_TTL : DNS_NEG_TTL);
+  e->refcnt = 1;
+  return e;
+}
+
+/*
+ * make e the table's entry for its key, dropping the one it replaces
+ * and any expired entries on the same chain. Takes a second reference
+ * for the table; the caller keeps its own (lock held).
+ */
+static void dns_install(dns_entry_t *e)
+{
+  dns_entry_t **pp = &table[hash_str32(e->key) % DNS_BUCKETS], *p;
+  time_t now = mono_sec();
+
+  while ((p = *pp) != NULL)
+  {
+    if (!strcmp(p->key, e->key) || (now >= p->expires && !p->refreshing))
+    {
+      *pp = p->next;
+      dns_release(p);
+    }
+    else
+      pp = &p->next;
+  }
+  __atomic_add_fetch(&e->refcnt, 1, __ATOMIC_RELAXED);
+  e->next = table[hash_str32(e->key) % DNS_BUCKETS];
+  table[hash_str32(e->key) % DNS_BUCKETS] = e;
+}
+
+/* re-resolve queued names ahead of their expiry */
+static void *dns_refresher(void *vargp)
+{
+  char host[MAXLINE], *port;
+  dns_entry_t *old, *e;
+
+  while (1)
+  {
+    pthread_mutex_lock(&lock);
+    while (todo == NULL)
+      pthread_cond_wait(&todo_cond, &lock);
+    old = todo;
+    todo = old->next_todo;
+    pthread_mutex_unlock(&lock);
+
+    /* the key is "host:port"; the port never contains ':' */
+    strcpy(host, old->key);
+    port = strrchr(host, ':');
+    *port++ = '\0';
+    e = dns_resolve(old->key, host, port);
+
+    pthread_mutex_lock(&lock);
+    if (e->list && *dns_find(old->key) == old)
+      dns_install(e);
+    old->refreshing = 0;
+    pthread_mutex_unlock(&lock);
+
+    dns_release(e);
+    dns_release(old);
+  }
+  return NULL;
+}
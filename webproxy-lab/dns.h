@@ -0,0 +1,25 @@
+/* dns.h - thread-safe cache of origin name lookups */
+#ifndef __DNS_H__
+#define __DNS_H__
+
+#include <netdb.h>
+
+/* may be overridden at build time, e.g. -DDNS_TTL=300 */
+#ifndef DNS_TTL
+#define DNS_TTL 60 /* seconds a successful lookup is reused */
+#endif
+#ifndef DNS_NEG_TTL
+#define DNS_NEG_TTL 5 /* seconds a failed lookup is remembered */
+#endif
+#ifndef DNS_REFRESH_RETRY
+#define DNS_REFRESH_RETRY 5 /* seconds between background refreshes of one entry */
+#endif
+
+typedef struct dns_entry dns_entry_t;
+
+void dns_init(int refresh); /* refresh: re-resolve hot names in the background */
+dns_entry_t *dns_lookup(const char *host, const char *port, struct addrinfo **list_ptr);
+void dns_release(dns_entry_t *e);
+int dns_open_clientfd(const char *host, const char *port, int timeout_ms);
+
+#endif /* __DNS_H__ */
@@ -0,0 +1,588 @@
+/*
+ * event.c - epoll-driven proxy engine (proxy -e)
+ *
+ * A single thread multiplexes every in-flight transaction. All sockets
+ * are non-blocking and each connection is a small state machine:
+ *
+ *   EV_READ_REQ -> EV_CONNECT -> EV_SEND_REQ -> EV_RELAY -> cache insert
+ *   EV_READ_REQ -> EV_SEND_HIT                             (cache hit)
+ *
+ * Each event_loop() call owns its epoll instance, so several loops
+ * (one per accept shard) can run side by side in separate threads.
+ * Names resolve through the cache in dns.c; only a miss blocks the loop.
+ */
+#include "csapp.h"
+#include "proxy.h"
+#include "cache.h"
+#include "dns.h"
+#include <sys/epoll.h>
+
+#define EV_MAXEVENTS 256
+
+enum ev_state
+{
+  EV_READ_REQ, /* accumulating the request head from the client */
+  EV_CONNECT,  /* non-blocking connect to the origin in progress */
+  EV_SEND_REQ, /* writing the rewritten request to the origin */
+  EV_RELAY,    /* copying the response origin -> client */
+  EV_SEND_HIT, /* writing a cached object to the client */
+  EV_DONE      /* closed; freed after the current epoll batch */
+};
+
+typedef struct ev_conn ev_conn_t;
+
+/* per-thread loop state */
+typedef struct
+{
+  int epfd;
+  ev_conn_t *dead_list; /* closed conns awaiting free */
+} ev_loop_t;
+
+/* one registered descriptor; epoll_event.data.ptr points here */
+typedef struct
+{
+  ev_conn_t *conn;
+  int fd;          /* -1 when not open */
+  uint32_t events; /* current interest set */
+  int registered;
+} ev_handle_t;
+
+struct ev_conn
+{
+  ev_loop_t *loop;
+  enum ev_state state;
+  ev_handle_t client;
+  ev_handle_t server;
+  char *cache_key;                /* host + path (malloc'd) */
+  char req[MAXBUF];               /* request head from the client */
+  size_t req_len;
+  const char *out;                /* upstream request or cached object */
+  size_t out_len, out_off;
+  char *out_buf;                  /* malloc'd bytes behind out, if any */
+  cache_obj_t *hit;               /* cache reference behind out, if any */
+  char buf[MAXBUF];               /* response chunk not yet sent to client */
+  size_t buf_len, buf_off;
+  cache_fill_t fill;              /* response copy for the cache */
+  int head_off;                   /* fill bytes of the response head checked so far */
+  int head_done;                  /* the head's empty line has been seen */
+  int status, nostore;            /* what the head says about caching */
+  long content_length;            /* body length the head promises, -1 if none */
+  int chunked;                    /* Transfer-Encoding: chunked */
+  dns_entry_t *dns;               /* pins the origin addresses below */
+  struct addrinfo *addr;          /* next candidate address */
+  ev_conn_t *next_dead;
+};
+
+static void ev_accept(ev_loop_t *loop, int listenfd);
+static void ev_dispatch(ev_handle_t *h, uint32_t events);
+static void ev_watch(ev_handle_t *h, uint32_t events);
+static void ev_read_request(ev_conn_t *c);
+static void ev_start(ev_conn_t *c);
+static void ev_connect_next(ev_conn_t *c);
+static void ev_finish_connect(ev_conn_t *c);
+static void ev_send_request(ev_conn_t *c);
+static void ev_send_hit(ev_conn_t *c);
+static void ev_relay(ev_conn_t *c);
+static void ev_check_head(ev_conn_t *c);
+static void ev_close(ev_conn_t *c);
+
+static int would_block(void)
+{
+  return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+static void set_nonblocking(int fd)
+{
+  int flags;
+
+  if ((flags = fcntl(fd, F_GETFL, 0)) < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+    unix_error("fcntl error");
+}
+
+/* ---------- main loop ---------- */
+void event_loop(int listenfd)
+{
+  struct epoll_event ev, events[EV_MAXEVENTS];
+  ev_loop_t loop;
+  int i, n;
+  ev_conn_t *c;
+
+  set_nonblocking(listenfd);
+  if ((loop.epfd = epoll_create1(0)) < 0)
+    unix_error("epoll_create1 error");
+  loop.dead_list = NULL;
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL; /* NULL marks the listening socket */
+  if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0)
+    unix_error("epoll_ctl error");
+
+  while (1)
+  {
+    if ((n = epoll_wait(loop.epfd, events, EV_MAXEVENTS, -1)) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      unix_error("epoll_wait error");
+    }
+
+    for (i = 0; i < n; i++)
+    {
+      if (events[i].data.ptr == NULL)
+        ev_accept(&loop, listenfd);
+      else
+        ev_dispatch(events[i].data.ptr, events[i].events);
+    }
+
+    /* events later in the batch may still have pointed at these */
+    while ((c = loop.dead_list) != NULL)
+    {
+      loop.dead_list = c->next_dead;
+      Free(c);
+    }
+  }
+}
+
+/* accept every pending client */
+static void ev_accept(ev_loop_t *loop, int listenfd)
+{
+  struct sockaddr_storage clientaddr;
+  socklen_t clientlen;
+  ev_conn_t *c;
+  int connfd;
+
+  while (1)
+  {
+    clientlen = sizeof(clientaddr);
+    connfd = accept(listenfd, (SA *)&clientaddr, &clientlen);
+    if (connfd < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (!would_block())
+        fprintf(stderr, "accept error: %s\n", strerror(errno));
+      return;
+    }
+    set_nonblocking(connfd);
+
+    c = Calloc(1, sizeof(ev_conn_t));
+    c->loop = loop;
+    c->state = EV_READ_REQ;
+    c->client.conn = c;
+    c->client.fd = connfd;
+    c->server.conn = c;
+    c->server.fd = -1;
+    cache_fill_init(&c->fill);
+    c->content_length = -1;
+    ev_watch(&c->client, EPOLLIN);
+  }
+}
+
+/* route a readiness event to the handler for the connection's state */
+static void ev_dispatch(ev_handle_t *h, uint32_t events)
+{
+  ev_conn_t *c = h->conn;
+
+  if (c->state == EV_DONE)
+    return;
+  if (h == &c->client && (events & (EPOLLERR | EPOLLHUP)))
+  {
+    ev_close(c); /* client went away; nothing left to deliver */
+    return;
+  }
+
+  switch (c->state)
+  {
+  case EV_READ_REQ:
+    ev_read_request(c);
+    break;
+  case EV_CONNECT:
+    ev_finish_connect(c);
+    break;
+  case EV_SEND_REQ:
+    ev_send_request(c);
+    break;
+  case EV_RELAY:
+    ev_relay(c);
+    break;
+  case EV_SEND_HIT:
+    ev_send_hit(c);
+    break;
+  case EV_DONE:
+    break;
+  }
+}
+
+/* set the interest set of h, registering it on first use */
+static void ev_watch(ev_handle_t *h, uint32_t events)
+{
+  struct epoll_event ev;
+
+  if (h->registered && h->events == events)
+    return;
+  ev.events = events;
+  ev.data.ptr = h;
+  if (epoll_ctl(h->conn->loop->epfd, h->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, h->fd, &ev) < 0)
+    unix_error("epoll_ctl error");
+  h->registered = 1;
+  h->events = events;
+}
+
+/* ---------- EV_READ_REQ ---------- */
+static void ev_read_request(ev_conn_t *c)
+{
+  ssize_t n;
+
+  while (1)
+  {
+    n = read(c->client.fd, c->req + c->req_len, sizeof(c->req) - 1 - c->req_len);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (!would_block())
+        ev_close(c);
+      return;
+    }
+    if (n == 0)
+    {
+      ev_close(c);
+      return;
+    }
+
+    c->req_len += n;
+    c->req[c->req_len] = '\0';
+    if (strstr(c->req, "\r\n\r\n"))
+      break;
+    if (c->req_len == sizeof(c->req) - 1)
+    {
+      printf("Request head too large, dropping\n");
+      ev_close(c);
+      return;
+    }
+  }
+
+  ev_start(c);
+}
+
+/* parse the buffered head, then serve from cache or start the origin fetch */
+static void ev_start(ev_conn_t *c)
+{
+  char method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+  char hostname[MAXLINE], pathname[MAXLINE];
+  char http_header[MAXLINE], port_str[8];
+  const char *p;
+  http_span_t line;
+  http_field_t f;
+  int port, size, len;
+
+  method[0] = '\0';
+  ev_watch(&c->client, 0); /* the head is complete; ignore further input */
+  printf("Request: %.*s", (int)(strstr(c->req, "\r\n") + 2 - c->req), c->req);
+  if (sscanf(c->req, "%s %s %s", method, uri, version) != 3 || strcasecmp(method, "GET"))
+  {
+    printf("Proxy does not implement method %s\n", method);
+    ev_close(c);
+    return;
+  }
+  if (parse_uri(uri, hostname, pathname, &port) < 0)
+  {
+    printf("parse_uri failed for uri=%s\n", uri);
+    ev_close(c);
+    return;
+  }
+
+  c->cache_key = Malloc(strlen(hostname) + strlen(pathname) + 1);
+  sprintf(c->cache_key, "%s%s", hostname, pathname);
+
+  if ((c->hit = cache_get(c->cache_key, &c->out, &size)) != NULL)
+  {
+    c->out_len = size;
+    c->state = EV_SEND_HIT;
+    ev_send_hit(c);
+    return;
+  }
+
+  /* header lines follow the request line; the head ends with an empty line */
+  len = start_http_header(http_header, hostname, pathname, 0);
+  p = strstr(c->req, "\r\n") + 2;
+  while (http_next_line(&p, c->req + c->req_len, &line) && !http_is_blank(&line))
+  {
+    http_parse_field(&line, &f);
+    len = add_client_header(http_header, len, &f);
+  }
+  c->out_len = finish_http_header(http_header, len, 0);
+  c->out_buf = Malloc(c->out_len);
+  memcpy(c->out_buf, http_header, c->out_len);
+  c->out = c->out_buf;
+
+  snprintf(port_str, sizeof(port_str), "%d", port);
+  if ((c->dns = dns_lookup(hostname, port_str, &c->addr)) == NULL)
+  {
+    ev_close(c);
+    return;
+  }
+  c->state = EV_CONNECT;
+  ev_connect_next(c);
+}
+
+/* ---------- EV_CONNECT ---------- */
+/* start a connect to the next candidate address */
+static void ev_connect_next(ev_conn_t *c)
+{
+  int fd;
+
+  for (; c->addr; c->addr = c->addr->ai_next)
+  {
+    fd = socket(c->addr->ai_family, c->addr->ai_socktype, c->addr->ai_protocol);
+    if (fd < 0)
+      continue;
+    set_nonblocking(fd);
+
+    c->server.fd = fd;
+    c->server.registered = 0;
+    if (connect(fd, c->addr->ai_addr, c->addr->ai_addrlen) == 0)
+    {
+      ev_finish_connect(c);
+      return;
+    }
+    if (errno == EINPROGRESS)
+    {
+      ev_watch(&c->server, EPOLLOUT);
+      return;
+    }
+    close(fd);
+    c->server.fd = -1;
+  }
+
+  printf("connect failed for %s\n", c->cache_key);
+  ev_close(c);
+}
+
+static void ev_finish_connect(ev_conn_t *c)
+{
+  int err = 0;
+  socklen_t len = sizeof(err);
+
+  if (getsockopt(c->server.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+    err = errno;
+  if (err)
+  {
+    close(c->server.fd); /* also drops it from the epoll set */
+    c->server.fd = -1;
+    c->addr = c->addr->ai_next;
+    ev_connect_next(c);
+    return;
+  }
+
+  dns_release(c->dns);
+  c->dns = NULL;
+  c->addr = NULL;
+  c->state = EV_SEND_REQ;
+  ev_send_request(c);
+}
+
+/* ---------- EV_SEND_REQ ---------- */
+static void ev_send_request(ev_conn_t *c)
+{
+  ssize_t n;
+
+  while (c->out_off < c->out_len)
+  {
+    n = write(c->server.fd, c->out + c->out_off, c->out_len - c->out_off);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (would_block())
+        ev_watch(&c->server, EPOLLOUT);
+      else
+        ev_close(c);
+      return;
+    }
+    c->out_off += n;
+  }
+
+  Free(c->out_buf);
+  c->out_buf = NULL;
+  c->out = NULL;
+  c->state = EV_RELAY;
+  ev_watch(&c->client, 0); /* HUP/ERR are still reported */
+  ev_watch(&c->server, EPOLLIN);
+}
+
+/* ---------- EV_SEND_HIT ---------- */
+static void ev_send_hit(ev_conn_t *c)
+{
+  ssize_t n;
+
+  while (c->out_off < c->out_len)
+  {
+    n = write(c->client.fd, c->out + c->out_off, c->out_len - c->out_off);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (would_block())
+        ev_watch(&c->client, EPOLLOUT);
+      else
+        ev_close(c);
+      return;
+    }
+    c->out_off += n;
+  }
+  ev_close(c);
+}
+
+/* ---------- EV_RELAY ---------- */
+/*
+ * Alternate between flushing the pending chunk to the client and
+ * reading the next one from the origin. Only one side is watched at a
+ * time, so a slow client throttles the origin read instead of
+ * buffering without bound.
+ */
+static void ev_relay(ev_conn_t *c)
+{
+  ssize_t n;
+
+  while (1)
+  {
+    while (c->buf_off < c->buf_len)
+    {
+      n = write(c->client.fd, c->buf + c->buf_off, c->buf_len - c->buf_off);
+      if (n < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        if (would_block())
+        {
+          ev_watch(&c->server, 0);
+          ev_watch(&c->client, EPOLLOUT);
+        }
+        else
+          ev_close(c);
+        return;
+      }
+      c->buf_off += n;
+    }
+    c->buf_len = c->buf_off = 0;
+
+    n = read(c->server.fd, c->buf, sizeof(c->buf));
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (would_block())
+      {
+        ev_watch(&c->client, 0);
+        ev_watch(&c->server, EPOLLIN);
+      }
+      else
+        ev_close(c);
+      return;
+    }
+    if (n == 0) /* origin finished the response */
+    {
+      if (!c->head_done) /* never a whole head: nothing worth keeping */
+        cache_fill_abandon(&c->fill);
+      else if (c->fill.ok && c->content_length >= 0 &&
+               c->fill.len - c->head_off != c->content_length)
+        cache_fill_abandon(&c->fill); /* never cache a truncated body */
+      else if (c->fill.ok && c->content_length < 0)
+        fill_add_content_length(&c->fill, c->head_off); /* EOF-framed */
+      if (c->fill.ok && c->fill.len > 0)
+        printf("[Cache Insert] URI=%s, size=%d\n", c->cache_key, c->fill.len);
+      cache_fill_commit(&c->fill, c->cache_key, NULL);
+      ev_close(c);
+      return;
+    }
+
+    c->buf_len = n;
+    cache_fill_append(&c->fill, c->buf, n);
+    if (!c->head_done)
+      ev_check_head(c);
+  }
+}
+
+/*
+ * Walk the response head as it lands in the fill, line by line, and
+ * drop the copy as soon as the head is complete if response_cacheable()
+ * says no, the same rule the threaded engine applies. A chunked body
+ * is relayed as is but never cached, since nothing here decodes it;
+ * head_off ends up at the start of the body so the EOF check in
+ * ev_relay can hold it to Content-length.
+ */
+static void ev_check_head(ev_conn_t *c)
+{
+  const char *p, *end;
+  http_span_t line;
+  http_field_t f;
+  int minor;
+
+  if (!c->fill.ok) /* already too big to cache; the head no longer matters */
+    return;
+  p = c->fill.buf + c->head_off;
+  end = c->fill.buf + c->fill.len;
+  while (http_next_line(&p, end, &line))
+  {
+    if (c->head_off == 0)
+    {
+      if (http_parse_status(&line, &minor, &c->status) < 0)
+        c->status = 0;
+    }
+    else if (http_is_blank(&line))
+    {
+      c->head_done = 1;
+      c->head_off = p - c->fill.buf;
+      if (!response_cacheable(c->status, c->nostore) || c->chunked || line.len != 2)
+        cache_fill_abandon(&c->fill);
+      return;
+    }
+    else
+    {
+      http_parse_field(&line, &f);
+      switch (f.id)
+      {
+      case HTTP_HDR_CONTENT_LENGTH:
+        c->content_length = http_span_tol(&f.value);
+        break;
+      case HTTP_HDR_TRANSFER_ENCODING:
+        c->chunked = http_span_has(&f.value, "chunked");
+        break;
+      case HTTP_HDR_CACHE_CONTROL:
+        if (http_span_has(&f.value, "no-store") || http_span_has(&f.value, "private"))
+          c->nostore = 1;
+        break;
+      default:
+        break;
+      }
+    }
+    c->head_off = p - c->fill.buf;
+  }
+}
+
+/* ---------- teardown ---------- */
+static void ev_close(ev_conn_t *c)
+{
+  if (c->state == EV_DONE)
+    return;
+  c->state = EV_DONE;
+
+  /* close() also removes the descriptors from the epoll set */
+  if (c->client.fd >= 0)
+    close(c->client.fd);
+  if (c->server.fd >= 0)
+    close(c->server.fd);
+  if (c->dns)
+    dns_release(c->dns);
+  if (c->out_buf)
+    Free(c->out_buf);
+  if (c->hit)
+    cache_release(c->hit);
+  cache_fill_abandon(&c->fill);
+  if (c->cache_key)
+    Free(c->cache_key);
+
+  c->next_dead = c->loop->dead_list;
+  c->loop->dead_list = c;
+}
@@ -0,0 +1,173 @@
+/*
+ * http.c - in-place parsing of HTTP heads into spans
+ *
+ * Request and response heads are parsed where they were received:
+ * http_read_line hands out each line as a span into the rio buffer,
+ * and http_parse_field splits it into name and value spans and tags
+ * the headers the proxy acts on with an id, so callers switch on the
+ * id instead of comparing prefixes, and pass kept lines on with one
+ * copy into the outgoing head.
+ *
+ * A line must fit in the rio buffer (RIO_BUFSIZE); a longer one is an
+ * error, where rio_readlineb would have split it.
+ */
+#include "csapp.h"
+#include "http.h"
+#include <limits.h>
+
+static const struct
+{
+  const char *name;
+  int len;
+  enum http_hdr id;
+} known[] = {
+    {"Host", 4, HTTP_HDR_HOST},
+    {"Connection", 10, HTTP_HDR_CONNECTION},
+    {"Proxy-Connection", 16, HTTP_HDR_PROXY_CONNECTION},
+    {"Keep-Alive", 10, HTTP_HDR_KEEP_ALIVE},
+    {"User-Agent", 10, HTTP_HDR_USER_AGENT},
+    {"Content-Length", 14, HTTP_HDR_CONTENT_LENGTH},
+    {"Transfer-Encoding", 17, HTTP_HDR_TRANSFER_ENCODING},
+    {"Cache-Control", 13, HTTP_HDR_CACHE_CONTROL},
+};
+
+/* ---------- reading lines ---------- */
+/*
+ * Return the next line in rp's buffer, reading more when it holds only
+ * part of one (the part moves to the front first). Returns 1 with
+ * *line set, 0 at EOF before the line starts, and -1 on a read error,
+ * timeout, EOF mid-line or a line longer than the buffer.
+ */
+int http_read_line(rio_t *rp, http_span_t *line)
+{
+  char *nl;
+  int scanned = 0;
+  ssize_t n;
+
+  if (rp->rio_cnt < 0) /* rio_read leaves -1 behind after an error */
+    rp->rio_cnt = 0;
+  while ((nl = memchr(rp->rio_bufptr + scanned, '\n', rp->rio_cnt - scanned)) == NULL)
+  {
+    scanned = rp->rio_cnt;
+    if (rp->rio_bufptr != rp->rio_buf)
+    {
+      memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+      rp->rio_bufptr = rp->rio_buf;
+    }
+    if (rp->rio_cnt == sizeof(rp->rio_buf))
+      return -1;
+    n = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt, sizeof(rp->rio_buf) - rp->rio_cnt);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return (n == 0 && rp->rio_cnt == 0) ? 0 : -1;
+    rp->rio_cnt += n;
+  }
+
+  line->p = rp->rio_bufptr;
+  line->len = nl + 1 - rp->rio_bufptr;
+  rp->rio_bufptr += line->len;
+  rp->rio_cnt -= line->len;
+  return 1;
+}
+
+/* next header field from rp: 1, or 0 at the blank line ending the head, or -1 */
+int http_read_field(rio_t *rp, http_field_t *f)
+{
+  http_span_t line;
+
+  if (http_read_line(rp, &line) <= 0)
+    return -1;
+  if (http_is_blank(&line))
+    return 0;
+  http_parse_field(&line, f);
+  return 1;
+}
+
+/* next complete line of [*pp, end); returns 0 if there is none */
+int http_next_line(const char **pp, const char *end, http_span_t *line)
+{
+  const char *nl = memchr(*pp, '\n', end - *pp);
+
+  if (nl == NULL)
+    return 0;
+  line->p = *pp;
+  line->len = nl + 1 - *pp;
+  *pp = nl + 1;
+  return 1;
+}
+
+/* ---------- parsing ---------- */
+int http_is_blank(const http_span_t *line)
+{
+  return (line->len == 2 && line->p[0] == '\r') || line->len == 1;
+}
+
+/* split "Name: value CRLF" and identify the name; a line without a colon gets an empty name */
+void http_parse_field(const http_span_t *line, http_field_t *f)
+{
+  const char *colon = memchr(line->p, ':', line->len);
+  const char *v, *end = line->p + line->len;
+  int i;
+
+  f->line = *line;
+  f->id = HTTP_HDR_OTHER;
+  if (colon == NULL)
+  {
+    f->name.p = f->value.p = line->p;
+    f->name.len = f->value.len = 0;
+    return;
+  }
+
+  f->name.p = line->p;
+  f->name.len = colon - line->p;
+  for (i = 0; i < (int)(sizeof(known) / sizeof(known[0])); i++)
+    if (known[i].len == f->name.len && !strncasecmp(known[i].name, f->name.p, f->name.len))
+    {
+      f->id = known[i].id;
+      break;
+    }
+
+  for (v = colon + 1; v < end && (*v == ' ' || *v == '\t'); v++)
+    ;
+  while (end > v && (end[-1] == '\r' || end[-1] == '\n' || end[-1] == ' ' || end[-1] == '\t'))
+    end--;
+  f->value.p = v;
+  f->value.len = end - v;
+}
+
+/* "HTTP/1.x nnn ..." -> minor version and status; -1 if it is not a status line */
+int http_parse_status(const http_span_t *line, int *minor_ptr, int *status_ptr)
+{
+  const char *p = line->p;
+
+  if (line->len < 12 || strncmp(p, "HTTP/1.", 7) || !isdigit((unsigned char)p[7]) ||
+      p[8] != ' ' || !isdigit((unsigned char)p[9]) || !isdigit((unsigned char)p[10]) ||
+      !isdigit((unsigned char)p[11]))
+    return -1;
+  *minor_ptr = p[7] - '0';
+  *status_ptr = (p[9] - '0') * 100 + (p[10] - '0') * 10 + (p[11] - '0');
+  return 0;
+}
+
+/* does s contain token, ignoring case? */
+int http_span_has(const http_span_t *s, const char *token)
+{
+  int i, n = strlen(token);
+
+  for (i = 0; i + n <= s->len; i++)
+    if (!strncasecmp(s->p + i, token, n))
+      return 1;
+  return 0;
+}
+
+/* leading decimal digits of s, like atol; 0 if there are none */
+long http_span_tol(const http_span_t *s)
+{
+  long v = 0;
+  int i;
+
+  for (i = 0; i < s->len && isdigit((unsigned char)s->p[i]) && v < LONG_MAX / 10 - 1; i++)
+    v = v * 10 + (s->p[i] - '0');
+  return v;
+}
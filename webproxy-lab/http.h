@@ -0,0 +1,49 @@
+/* http.h - in-place parsing of HTTP heads into spans */
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include "csapp.h"
+
+/* bytes of a line or field somewhere else; not NUL-terminated */
+typedef struct
+{
+  const char *p;
+  int len;
+} http_span_t;
+
+/* header names the proxy acts on, recognised once per line */
+enum http_hdr
+{
+  HTTP_HDR_OTHER,
+  HTTP_HDR_HOST,
+  HTTP_HDR_CONNECTION,
+  HTTP_HDR_PROXY_CONNECTION,
+  HTTP_HDR_KEEP_ALIVE,
+  HTTP_HDR_USER_AGENT,
+  HTTP_HDR_CONTENT_LENGTH,
+  HTTP_HDR_TRANSFER_ENCODING,
+  HTTP_HDR_CACHE_CONTROL
+};
+
+typedef struct
+{
+  enum http_hdr id;
+  http_span_t line;  /* the whole line, CRLF included, for passing it on */
+  http_span_t name;
+  http_span_t value; /* without surrounding whitespace or CRLF */
+} http_field_t;
+
+/* lines straight from a rio buffer; valid until the next read on rp */
+int http_read_line(rio_t *rp, http_span_t *line);
+int http_read_field(rio_t *rp, http_field_t *f);
+
+/* lines from a buffer that already holds the head */
+int http_next_line(const char **pp, const char *end, http_span_t *line);
+
+int http_is_blank(const http_span_t *line);
+void http_parse_field(const http_span_t *line, http_field_t *f);
+int http_parse_status(const http_span_t *line, int *minor_ptr, int *status_ptr);
+int http_span_has(const http_span_t *s, const char *token);
+long http_span_tol(const http_span_t *s);
+
+#endif /* __HTTP_H__ */
@@ -0,0 +1,381 @@
+/*
+ * policy.c - eviction policies for the proxy cache
+ *
+ * The cache keeps its objects' index and memory; a policy only decides
+ * the order they leave in. Every lookup is reported (hit or miss),
+ * every object is inserted and removed once, and when the cache needs
+ * room it asks for a victim and removes it. All sizes are in bytes
+ * charged against the shard's budget.
+ *
+ *   lru      one list, hits move to the front, evict from the back.
+ *   clock    one FIFO with a reference bit per object: a hit only sets
+ *            the bit, and the hand gives referenced objects a second
+ *            trip round instead of evicting them.
+ *   s3fifo   a small FIFO (10% of the budget) that new objects enter,
+ *            a main FIFO for those hit while in it, and a ghost list of
+ *            keys recently dropped from the small one; a key found in
+ *            the ghost goes straight to main. Main is a CLOCK with a
+ *            two-bit counter. One-hit wonders never reach main, so a
+ *            scan cannot flush it.
+ *   tinylfu  W-TinyLFU: an LRU window (1%) in front of a segmented LRU
+ *            main (probation, then protected at 80% of it). An object
+ *            leaving the window only gets into main if a count-min
+ *            sketch of recent lookups says it is more popular than the
+ *            object main would evict for it.
+ */
+#include "csapp.h"
+#include "policy.h"
+
+#define POLICY_QUEUES 3
+#define S3_SMALL_PCT 10       /* s3fifo: small queue's share of the budget */
+#define S3_FREQ_MAX 3         /* s3fifo: saturating hit counter */
+#define TLFU_WINDOW_PCT 1     /* tinylfu: window's share of the budget */
+#define TLFU_PROTECTED_PCT 80 /* tinylfu: protected segment's share of main */
+#define TLFU_ROWS 4           /* tinylfu: count-min sketch depth */
+#define TLFU_COUNT_MAX 15     /* tinylfu: counters saturate here */
+#define POLICY_TABLE_MIN 1024    /* slots in a ghost table or sketch row, at least */
+#define POLICY_TABLE_MAX (1 << 22) /* and at most, however large the shard */
+#define POLICY_AVG_OBJECT 1024   /* sizes the ghost table and sketch from the budget */
+
+enum
+{
+  Q_MAIN, /* lru/clock: the only queue; s3fifo: main; tinylfu: probation */
+  Q_SMALL, /* s3fifo: small; tinylfu: window */
+  Q_PROTECTED /* tinylfu only */
+};
+
+typedef struct
+{
+  void (*access)(policy_t *p, uint64_t hash, policy_node_t *hit);
+  void (*insert)(policy_t *p, policy_node_t *n);
+  policy_node_t *(*victim)(policy_t *p);
+} policy_ops_t;
+
+struct policy
+{
+  const policy_ops_t *ops;
+  size_t budget;
+  policy_node_t *head[POLICY_QUEUES]; /* newest */
+  policy_node_t *tail[POLICY_QUEUES]; /* oldest */
+  size_t bytes[POLICY_QUEUES];
+  size_t count; /* objects in all queues */
+
+  /* s3fifo ghost: direct-mapped key tags, each stamped with when it left */
+  struct
+  {
+    uint32_t tag;  /* high half of the hash; the low bits pick the slot */
+    uint32_t when; /* ghost_clock then; compared modulo 2^32 */
+  } *ghost;
+  size_t ghost_mask;
+  uint32_t ghost_clock;
+
+  /* tinylfu: TLFU_ROWS rows of sketch_mask + 1 counters, halved as they age */
+  unsigned char *sketch;
+  size_t sketch_mask;
+  size_t sketch_adds;
+};
+
+/* ---------- queues ---------- */
+static void q_push(policy_t *p, int q, policy_node_t *n)
+{
+  n->queue = q;
+  n->prev = NULL;
+  n->next = p->head[q];
+  if (n->next)
+    n->next->prev = n;
+  else
+    p->tail[q] = n;
+  p->head[q] = n;
+  p->bytes[q] += n->charge;
+}
+
+static void q_unlink(policy_t *p, policy_node_t *n)
+{
+  int q = n->queue;
+
+  if (n->prev)
+    n->prev->next = n->next;
+  else
+    p->head[q] = n->next;
+  if (n->next)
+    n->next->prev = n->prev;
+  else
+    p->tail[q] = n->prev;
+  p->bytes[q] -= n->charge;
+}
+
+static void q_move(policy_t *p, int q, policy_node_t *n)
+{
+  q_unlink(p, n);
+  q_push(p, q, n);
+}
+
+/* ---------- lru ---------- */
+static void lru_access(policy_t *p, uint64_t hash, policy_node_t *hit)
+{
+  if (hit)
+    q_move(p, Q_MAIN, hit);
+}
+
+static void lru_insert(policy_t *p, policy_node_t *n)
+{
+  q_push(p, Q_MAIN, n);
+}
+
+static policy_node_t *lru_victim(policy_t *p)
+{
+  return p->tail[Q_MAIN];
+}
+
+/* ---------- clock ---------- */
+static void clock_access(policy_t *p, uint64_t hash, policy_node_t *hit)
+{
+  if (hit)
+    hit->freq = 1;
+}
+
+static void clock_insert(policy_t *p, policy_node_t *n)
+{
+  n->freq = 0;
+  q_push(p, Q_MAIN, n);
+}
+
+/* the oldest end is under the hand; a referenced object goes round again */
+static policy_node_t *clock_victim(policy_t *p)
+{
+  policy_node_t *n;
+
+  while ((n = p->tail[Q_MAIN]) != NULL && n->freq)
+  {
+    n->freq = 0;
+    q_move(p, Q_MAIN, n);
+  }
+  return n;
+}
+
+/* ---------- s3fifo ---------- */
+static void s3_access(policy_t *p, uint64_t hash, policy_node_t *hit)
+{
+  if (hit && hit->freq < S3_FREQ_MAX)
+    hit->freq++;
+}
+
+/* a key counts as a ghost until about a cache's worth of objects has left after it */
+static void s3_insert(policy_t *p, policy_node_t *n)
+{
+  size_t i = n->hash & p->ghost_mask;
+
+  n->freq = 0;
+  if (p->ghost[i].tag == (uint32_t)(n->hash >> 32) &&
+      (uint32_t)(p->ghost_clock - p->ghost[i].when) <= p->count + 1)
+  {
+    p->ghost[i].tag = 0;
+    q_push(p, Q_MAIN, n);
+  }
+  else
+    q_push(p, Q_SMALL, n);
+}
+
+static policy_node_t *s3_victim(policy_t *p)
+{
+  policy_node_t *n;
+  size_t i;
+
+  while (1)
+  {
+    if (p->tail[Q_SMALL] &&
+        (p->bytes[Q_SMALL] * 100 > p->budget * S3_SMALL_PCT || p->tail[Q_MAIN] == NULL))
+    {
+      n = p->tail[Q_SMALL];
+      if (n->freq > 0) /* hit while on probation: keep it */
+      {
+        n->freq = 0;
+        q_move(p, Q_MAIN, n);
+        continue;
+      }
+      i = n->hash & p->ghost_mask;
+      p->ghost[i].tag = n->hash >> 32;
+      p->ghost[i].when = ++p->ghost_clock;
+      return n;
+    }
+    if ((n = p->tail[Q_MAIN]) == NULL)
+      return NULL;
+    if (n->freq == 0)
+      return n;
+    n->freq--;
+    q_move(p, Q_MAIN, n);
+  }
+}
+
+/* ---------- tinylfu ---------- */
+/* row r's counter for hash: double hashing over the two halves */
+static unsigned char *tlfu_counter(policy_t *p, uint64_t hash, int r)
+{
+  uint64_t h1 = hash, h2 = (hash >> 32) | 1;
+
+  return &p->sketch[r * (p->sketch_mask + 1) + ((h1 + r * h2) & p->sketch_mask)];
+}
+
+static int tlfu_frequency(policy_t *p, uint64_t hash)
+{
+  int r, f, min = TLFU_COUNT_MAX;
+
+  for (r = 0; r < TLFU_ROWS; r++)
+    if ((f = *tlfu_counter(p, hash, r)) < min)
+      min = f;
+  return min;
+}
+
+/* count one lookup; after ten per counter, halve them all so old popularity fades */
+static void tlfu_count(policy_t *p, uint64_t hash)
+{
+  size_t i, n = TLFU_ROWS * (p->sketch_mask + 1);
+  unsigned char *c;
+  int r;
+
+  for (r = 0; r < TLFU_ROWS; r++)
+    if (*(c = tlfu_counter(p, hash, r)) < TLFU_COUNT_MAX)
+      (*c)++;
+  if (++p->sketch_adds >= 10 * (p->sketch_mask + 1))
+  {
+    for (i = 0; i < n; i++)
+      p->sketch[i] >>= 1;
+    p->sketch_adds /= 2;
+  }
+}
+
+static void tlfu_access(policy_t *p, uint64_t hash, policy_node_t *hit)
+{
+  policy_node_t *demoted;
+
+  tlfu_count(p, hash);
+  if (hit == NULL)
+    return;
+  if (hit->queue != Q_MAIN)
+  {
+    q_move(p, hit->queue, hit); /* window or protected: most recent again */
+    return;
+  }
+
+  /* a second hit promotes out of probation; protected overflows back into it */
+  q_move(p, Q_PROTECTED, hit);
+  while (p->bytes[Q_PROTECTED] * 100 > (p->budget - p->bytes[Q_SMALL]) * TLFU_PROTECTED_PCT &&
+         (demoted = p->tail[Q_PROTECTED]) != hit)
+    q_move(p, Q_MAIN, demoted);
+}
+
+static void tlfu_insert(policy_t *p, policy_node_t *n)
+{
+  q_push(p, Q_SMALL, n);
+}
+
+/*
+ * An overfull window's oldest object is the candidate. While main has
+ * room it goes straight in; after that it enters only if the sketch
+ * ranks it above main's victim, which is then evicted instead.
+ * Otherwise main evicts from probation first.
+ */
+static policy_node_t *tlfu_victim(policy_t *p)
+{
+  policy_node_t *cand, *victim;
+
+  while ((cand = p->tail[Q_SMALL]) != NULL &&
+         p->bytes[Q_SMALL] * 100 > p->budget * TLFU_WINDOW_PCT)
+  {
+    if ((p->bytes[Q_MAIN] + p->bytes[Q_PROTECTED] + cand->charge) * 100 <=
+        p->budget * (100 - TLFU_WINDOW_PCT))
+    {
+      q_move(p, Q_MAIN, cand);
+      continue;
+    }
+    victim = p->tail[Q_MAIN] ? p->tail[Q_MAIN] : p->tail[Q_PROTECTED];
+    if (victim && tlfu_frequency(p, cand->hash) <= tlfu_frequency(p, victim->hash))
+      return cand;
+    q_move(p, Q_MAIN, cand);
+    if (victim)
+      return victim;
+  }
+  if (p->tail[Q_MAIN])
+    return p->tail[Q_MAIN];
+  if (p->tail[Q_PROTECTED])
+    return p->tail[Q_PROTECTED];
+  return p->tail[Q_SMALL];
+}
+
+/* ---------- public interface ---------- */
+static const struct
+{
+  const char *name;
+  policy_ops_t ops;
+} policies[] = {
+    {"lru", {lru_access, lru_insert, lru_victim}},
+    {"clock", {clock_access, clock_insert, clock_victim}},
+    {"s3fifo", {s3_access, s3_insert, s3_victim}},
+    {"tinylfu", {tlfu_access, tlfu_insert, tlfu_victim}},
+};
+
+static const policy_ops_t *policy_find(const char *name)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof(policies) / sizeof(policies[0]); i++)
+    if (!strcmp(policies[i].name, name))
+      return &policies[i].ops;
+  return NULL;
+}
+
+int policy_exists(const char *name)
+{
+  return policy_find(name) != NULL;
+}
+
+/* NULL if name is unknown */
+policy_t *policy_create(const char *name, size_t budget)
+{
+  const policy_ops_t *ops = policy_find(name);
+  size_t slots = POLICY_TABLE_MIN;
+  policy_t *p;
+
+  if (ops == NULL)
+    return NULL;
+  p = Calloc(1, sizeof(policy_t));
+  p->ops = ops;
+  p->budget = budget;
+
+  /* room for about as many keys as the shard holds objects */
+  while (slots < budget / POLICY_AVG_OBJECT && slots < POLICY_TABLE_MAX)
+    slots *= 2;
+  if (p->ops->insert == s3_insert)
+  {
+    p->ghost = Calloc(slots, sizeof(*p->ghost));
+    p->ghost_mask = slots - 1;
+  }
+  else if (p->ops->insert == tlfu_insert)
+  {
+    p->sketch = Calloc(TLFU_ROWS * slots, 1);
+    p->sketch_mask = slots - 1;
+  }
+  return p;
+}
+
+void policy_access(policy_t *p, uint64_t hash, policy_node_t *hit)
+{
+  p->ops->access(p, hash, hit);
+}
+
+void policy_insert(policy_t *p, policy_node_t *n)
+{
+  p->ops->insert(p, n);
+  p->count++;
+}
+
+void policy_remove(policy_t *p, policy_node_t *n)
+{
+  q_unlink(p, n);
+  p->count--;
+}
+
+policy_node_t *policy_victim(policy_t *p)
+{
+  return p->ops->victim(p);
+}
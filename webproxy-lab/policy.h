@@ -0,0 +1,32 @@
+/* policy.h - eviction policies for the proxy cache, one instance per shard */
+#ifndef __POLICY_H__
+#define __POLICY_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* embedded in each cached object; the policy owns everything but hash and charge */
+typedef struct policy_node
+{
+  struct policy_node *prev;
+  struct policy_node *next;
+  uint64_t hash;       /* the object's key hash */
+  size_t charge;       /* bytes the object counts for */
+  unsigned char queue; /* which of the policy's queues holds it */
+  unsigned char freq;  /* recent hits, as the policy counts them */
+} policy_node_t;
+
+typedef struct policy policy_t;
+
+#define POLICY_NAMES "lru, clock, s3fifo, tinylfu"
+
+int policy_exists(const char *name); /* is name one of POLICY_NAMES? */
+policy_t *policy_create(const char *name, size_t budget); /* budget: the shard's bytes */
+
+/* the shard's lock is held for all of these */
+void policy_access(policy_t *p, uint64_t hash, policy_node_t *hit); /* every lookup */
+void policy_insert(policy_t *p, policy_node_t *n);
+void policy_remove(policy_t *p, policy_node_t *n);
+policy_node_t *policy_victim(policy_t *p); /* next to evict, still linked; NULL if empty */
+
+#endif /* __POLICY_H__ */
@@ -1,153 +1,647 @@
-/* proxy.c - proxy with thread-safe LRU cache for CS:APP proxylab */
+/* proxy.c - concurrent caching proxy for CS:APP proxylab (cache in cache.c) */
 
+#define _GNU_SOURCE /* pthread_setaffinity_np */
 #include "csapp.h"
+#include "sbuf.h"
+#include "proxy.h"
+#include "cache.h"
+#include "policy.h"
+#include "upstream.h"
+#include "dns.h"
+#include "http.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 512000
+/* worker pool defaults (overridable on the command line) */
+#define DEFAULT_NTHREADS 8     /* workers started at boot; also the floor */
+#define DEFAULT_MAXTHREADS 64  /* ceiling for dynamic growth */
+#define DEFAULT_QUEUE_DEPTH 64 /* accepted fds waiting for a worker */
+#define POOL_TICK_USEC 100000  /* manager sampling period */
+#define POOL_IDLE_TICKS 50     /* quiet ticks (5s) before shrinking */
+#define MAX_SHARDS 256         /* upper bound for -s */
+#define DEFAULT_STACK_KB 256   /* worker thread stacks; see txn_t */
+
+#define SPLICE_CHUNK 65536 /* bytes per splice() through the relay pipe */
+#define HEADER_TAIL_ROOM 256 /* kept free in the origin request for our own headers */
+
+/* client keep-alive defaults (overridable on the command line) */
+#define DEFAULT_IDLE_SEC 5       /* close a client connection idle this long */
+#define DEFAULT_MAX_REQUESTS 100 /* requests served per client connection */
+#define DEFAULT_CONNECT_MS 3000  /* deadline for connecting to an origin */
+#define DEFAULT_CACHE_POLICY "lru" /* cache eviction policy */
 
 static const char *user_agent_hdr =
     "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 "
     "Firefox/10.0.3\r\n";
 
-/* ---------- cache data structures ---------- */
-typedef struct cache_obj
+/* ---------- worker pool ---------- */
+typedef struct
+{
+  sbuf_t sbuf;    /* accepted descriptors waiting for a worker */
+  int nthreads;   /* live workers, not counting pending retirements */
+  int minthreads; /* never shrink below this */
+  int maxthreads; /* never grow above this */
+  int busy;       /* workers currently serving a connection */
+  pthread_mutex_t lock;
+} pool_t;
+
+/* ---------- per-connection context ---------- */
+/*
+ * Everything a worker needs while serving one client connection. Each
+ * worker allocates one when it starts and reuses it for every
+ * connection it takes, so the buffers stay off its stack and workers
+ * run on small stacks (-S).
+ */
+typedef struct
+{
+  int connfd;
+  rio_t client_rio;                     /* client requests, pipelined ones buffered */
+  rio_t server_rio;                     /* the current origin response */
+  char line[MAXLINE];                   /* request line, split in place */
+  char hostname[NI_MAXHOST];
+  char pathname[MAXLINE];
+  char cache_key[CACHE_KEY_MAX]; /* hostname + pathname */
+  char request[MAXLINE];                /* request sent to the origin */
+  char hdr[MAXBUF];                     /* response header lines batched for the client */
+} txn_t;
+
+/* ---------- accept shards ---------- */
+typedef struct
+{
+  int listenfd; /* this shard's own SO_REUSEPORT socket */
+  int cpu;      /* CPU the shard is pinned to, or -1 */
+  pool_t pool;  /* this shard's worker set (thread engine only) */
+} shard_t;
+
+/* startup settings shared by every shard */
+static struct
 {
-  char *uri;  /* key (malloc'd) */
-  char *data; /* response bytes (malloc'd) */
-  int size;   /* total bytes in data */
-  struct cache_obj *prev;
-  struct cache_obj *next;
-} cache_obj_t;
-
-static cache_obj_t *cache_head = NULL; /* most-recently-used */
-static cache_obj_t *cache_tail = NULL; /* least-recently-used */
-static int cache_total_size = 0;
-static pthread_mutex_t cache_lock;
+  int nthreads;   /* initial/minimum workers per shard */
+  int maxthreads; /* maximum workers per shard */
+  int qdepth;     /* accept queue depth per shard */
+  int evented;    /* 1: epoll engine instead of the worker pool */
+  int idle_sec;   /* client keep-alive idle timeout */
+  int maxreqs;    /* requests per client connection (1: no keep-alive) */
+  int dns_refresh; /* 1: refresh cached origin names in the background */
+  int connect_ms;  /* origin connect deadline */
+  int stack_kb;    /* worker thread stack size */
+  int nshards;     /* accept shards (0: one per CPU) */
+  int pin;         /* 1: pin shard i to CPU i */
+  size_t cache_size;     /* cache bytes over all its shards */
+  long cache_object;     /* largest response cached */
+  int cache_shards;      /* cache lock shards (0: as many as -C/-O allow) */
+  char cache_policy[16]; /* cache eviction policy (policy.h) */
+} conf = {DEFAULT_NTHREADS, DEFAULT_MAXTHREADS, DEFAULT_QUEUE_DEPTH, 0,
+          DEFAULT_IDLE_SEC, DEFAULT_MAX_REQUESTS, 0, DEFAULT_CONNECT_MS, DEFAULT_STACK_KB,
+          1, 0, MAX_CACHE_SIZE, MAX_OBJECT_SIZE, 0, DEFAULT_CACHE_POLICY};
+
+/* config file names for the command-line options (see load_config) */
+static const struct
+{
+  const char *name;
+  int opt;
+} conf_names[] = {
+    {"evented", 'e'},      {"threads", 'n'},         {"maxthreads", 'm'},
+    {"queue_depth", 'q'},  {"shards", 's'},          {"pin", 'p'},
+    {"idle_sec", 'i'},     {"max_requests", 'k'},    {"dns_refresh", 'r'},
+    {"connect_ms", 'c'},   {"stack_kb", 'S'},        {"cache_policy", 'P'},
+    {"cache_size", 'C'},   {"max_object_size", 'O'}, {"cache_shards", 'H'},
+};
+
+static pthread_attr_t worker_attr; /* conf.stack_kb stacks */
 
 /* ---------- function prototypes ---------- */
-void *thread(void *vargp);
-void doit(int connfd);
-int parse_uri(char *uri, char *hostname, char *pathname, int *port);
-void build_http_header(char *http_header, char *hostname, char *pathname, rio_t *client_rio);
-void forward_request_and_maybe_cache(int serverfd, rio_t *server_rio, int connfd, char *uri);
-void cache_init(void);
-int cache_get(const char *uri, char **buf_ptr, int *size_ptr); /* returns 1 if hit */
-void cache_put(const char *uri, const char *buf, int size);
-void cache_evict_if_needed(int needed);
-void cache_move_to_head(cache_obj_t *obj);
-void cache_remove(cache_obj_t *obj);
-void cache_free_obj(cache_obj_t *obj);
+int set_option(int opt, const char *arg);
+void load_config(const char *path);
+int parse_size(const char *arg, size_t *size_ptr);
+void *shard_main(void *vargp);
+void pin_to_cpu(int cpu);
+void pool_init(pool_t *pp, int minthreads, int maxthreads, int depth);
+void pool_spawn(pool_t *pp, int n);
+void *worker(void *vargp);
+void *pool_manager(void *vargp);
+void serve_client(txn_t *t, int connfd);
+int doit(txn_t *t, int last);
+int build_http_header(char *http_header, char *hostname, char *pathname, char *version,
+                      rio_t *client_rio, int *keepalive_ptr);
+int send_cached(int connfd, const char *buf, int size, int keepalive);
+int forward_request_and_maybe_cache(txn_t *t, cache_flight_t *flight, int *keepalive_ptr);
+ssize_t refill_rio(rio_t *rp);
+int relay_body(rio_t *server_rio, int connfd, long len, int *client_ok, cache_fill_t *fill);
+int relay_chunked(rio_t *server_rio, int connfd, int *client_ok, cache_fill_t *fill);
+int relay_splice(rio_t *server_rio, int connfd, long *len_ptr, int *client_ok);
 
 /* ---------- main ---------- */
 int main(int argc, char **argv)
 {
-  int listenfd, *connfdp;
-  socklen_t clientlen;
-  struct sockaddr_storage clientaddr;
+  int opt, i, rc, ncpus, nshards;
+  shard_t *shards;
   pthread_t tid;
 
-  if (argc != 2)
+  /* options apply in order, so flags after -f override the file */
+  while ((opt = getopt(argc, argv, "en:m:q:s:pi:k:rc:S:P:C:O:H:f:")) != -1)
   {
-    fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    if (opt == 'f')
+      load_config(optarg);
+    else if (set_option(opt, optarg) < 0)
+      optind = argc; /* force the usage message below */
+  }
+
+  if (optind != argc - 1 || conf.nthreads < 1 || conf.qdepth < 1 || conf.nshards < 0 ||
+      conf.nshards > MAX_SHARDS || conf.idle_sec < 1 || conf.maxreqs < 1 ||
+      conf.connect_ms < 1 || conf.stack_kb < 1 || !policy_exists(conf.cache_policy) ||
+      conf.cache_object < 1 || conf.cache_object > CACHE_OBJECT_LIMIT || conf.cache_shards < 0)
+  {
+    fprintf(stderr, "usage: %s [-e] [-n threads] [-m maxthreads] [-q queue_depth] "
+                    "[-s shards] [-p] [-i idle_sec] [-k max_requests] [-r] [-c connect_ms] "
+                    "[-S stack_kb] [-P lru|clock|s3fifo|tinylfu] [-C cache_size] "
+                    "[-O max_object_size] [-H cache_shards] [-f config] <port>\n",
+            argv[0]);
     exit(1);
   }
+  if (conf.maxthreads < conf.nthreads)
+    conf.maxthreads = conf.nthreads;
+
+  pthread_attr_init(&worker_attr);
+  if ((rc = pthread_attr_setstacksize(&worker_attr, (size_t)conf.stack_kb * 1024)) != 0)
+  {
+    fprintf(stderr, "-S %d: %s\n", conf.stack_kb, strerror(rc));
+    exit(1);
+  }
+
+  /* -s 0: one accept shard per online CPU */
+  ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (ncpus < 1)
+    ncpus = 1;
+  nshards = conf.nshards;
+  if (nshards == 0)
+    nshards = ncpus < MAX_SHARDS ? ncpus : MAX_SHARDS;
 
   Signal(SIGPIPE, SIG_IGN);
-  cache_init();
-  listenfd = Open_listenfd(argv[1]);
+  rc = cache_init(conf.cache_size, conf.cache_object, conf.cache_shards, conf.cache_policy);
+  if (conf.cache_shards > 0 && rc != conf.cache_shards) /* only a count asked for */
+    printf("[Cache] %d of %d shards: each must hold a %ld-byte object and key in %zu bytes\n", rc,
+           conf.cache_shards, conf.cache_object, conf.cache_size);
+  dns_init(conf.dns_refresh);
+  if (!conf.evented)
+    upstream_init(conf.connect_ms);
+
+  /* a single shard keeps the classic listener; more share the port */
+  shards = Calloc(nshards, sizeof(shard_t));
+  for (i = 0; i < nshards; i++)
+  {
+    shards[i].cpu = conf.pin ? i % ncpus : -1;
+    shards[i].listenfd = (nshards > 1) ? Open_listenfd_reuseport(argv[optind])
+                                       : Open_listenfd(argv[optind]);
+  }
+  if (nshards > 1)
+    printf("[Shard] %d accept loops on port %s%s\n", nshards, argv[optind],
+           conf.pin ? " (pinned)" : "");
+
+  for (i = 1; i < nshards; i++)
+    Pthread_create(&tid, NULL, shard_main, &shards[i]);
+  shard_main(&shards[0]); /* never returns */
+  return 0;
+}
+
+/* ---------- options ---------- */
+/*
+ * apply one option; arg is NULL for a bare flag. Returns -1 for an
+ * unknown option or a malformed size.
+ */
+int set_option(int opt, const char *arg)
+{
+  size_t size;
+
+  switch (opt)
+  {
+  case 'e':
+    conf.evented = arg ? atoi(arg) != 0 : 1;
+    break;
+  case 'n':
+    conf.nthreads = atoi(arg);
+    break;
+  case 'm':
+    conf.maxthreads = atoi(arg);
+    break;
+  case 'q':
+    conf.qdepth = atoi(arg);
+    break;
+  case 's':
+    conf.nshards = atoi(arg);
+    break;
+  case 'p':
+    conf.pin = arg ? atoi(arg) != 0 : 1;
+    break;
+  case 'i':
+    conf.idle_sec = atoi(arg);
+    break;
+  case 'k':
+    conf.maxreqs = atoi(arg);
+    break;
+  case 'r':
+    conf.dns_refresh = arg ? atoi(arg) != 0 : 1;
+    break;
+  case 'c':
+    conf.connect_ms = atoi(arg);
+    break;
+  case 'S':
+    conf.stack_kb = atoi(arg);
+    break;
+  case 'P':
+    snprintf(conf.cache_policy, sizeof(conf.cache_policy), "%s", arg);
+    break;
+  case 'C':
+    if (parse_size(arg, &size) < 0)
+      return -1;
+    conf.cache_size = size;
+    break;
+  case 'O':
+    if (parse_size(arg, &size) < 0 || size > CACHE_OBJECT_LIMIT)
+      return -1;
+    conf.cache_object = size;
+    break;
+  case 'H':
+    conf.cache_shards = atoi(arg);
+    break;
+  default:
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Read options from a file of "name value" lines, one per option, with
+ * the names in conf_names; '#' starts a comment. Bare flags take 1 or 0.
+ * Any error is fatal.
+ */
+void load_config(const char *path)
+{
+  char line[MAXLINE], name[MAXLINE], value[MAXLINE];
+  FILE *fp = fopen(path, "r");
+  int lineno = 0, n, i;
+  char *hash;
+
+  if (fp == NULL)
+  {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+  while (fgets(line, sizeof(line), fp))
+  {
+    lineno++;
+    if ((hash = strchr(line, '#')) != NULL)
+      *hash = '\0';
+    if ((n = sscanf(line, "%s %s", name, value)) <= 0)
+      continue;
+    for (i = 0; i < (int)(sizeof(conf_names) / sizeof(conf_names[0])); i++)
+      if (!strcmp(conf_names[i].name, name))
+        break;
+    if (n != 2 || i == (int)(sizeof(conf_names) / sizeof(conf_names[0])) ||
+        set_option(conf_names[i].opt, value) < 0)
+    {
+      fprintf(stderr, "%s:%d: bad setting \"%s\"\n", path, lineno, name);
+      exit(1);
+    }
+  }
+  fclose(fp);
+}
+
+/* "64M"-style byte counts: digits with an optional K, M or G (powers of 1024) */
+int parse_size(const char *arg, size_t *size_ptr)
+{
+  unsigned long long v;
+  char *end;
+  int shift = 0;
+
+  errno = 0;
+  v = strtoull(arg, &end, 10);
+  if (end == arg || errno || *arg == '-')
+    return -1;
+  switch (*end)
+  {
+  case 'k':
+  case 'K':
+    shift = 10;
+    end++;
+    break;
+  case 'm':
+  case 'M':
+    shift = 20;
+    end++;
+    break;
+  case 'g':
+  case 'G':
+    shift = 30;
+    end++;
+    break;
+  }
+  if (*end != '\0' || v > (SIZE_MAX >> shift))
+    return -1;
+  *size_ptr = (size_t)v << shift;
+  return 0;
+}
+
+/* ---------- accept shards ---------- */
+/* one accept loop feeding its own workers (or its own epoll loop) */
+void *shard_main(void *vargp)
+{
+  shard_t *sp = (shard_t *)vargp;
+  socklen_t clientlen;
+  struct sockaddr_storage clientaddr;
+  int connfd;
+
+  /* workers spawned below inherit this thread's CPU mask */
+  if (sp->cpu >= 0)
+    pin_to_cpu(sp->cpu);
+
+  if (conf.evented)
+  {
+    event_loop(sp->listenfd); /* never returns */
+    return NULL;
+  }
 
+  pool_init(&sp->pool, conf.nthreads, conf.maxthreads, conf.qdepth);
   while (1)
   {
     clientlen = sizeof(clientaddr);
-    connfdp = Malloc(sizeof(int));
-    *connfdp = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-    Pthread_create(&tid, NULL, thread, connfdp);
+    connfd = Accept(sp->listenfd, (SA *)&clientaddr, &clientlen);
+    sbuf_insert(&sp->pool.sbuf, connfd); /* blocks while the queue is full */
   }
+  return NULL;
+}
 
-  return 0;
+/* restrict the calling thread to one CPU; failure is not fatal */
+void pin_to_cpu(int cpu)
+{
+  cpu_set_t set;
+  int rc;
+
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if ((rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) != 0)
+    fprintf(stderr, "pin_to_cpu(%d): %s\n", cpu, strerror(rc));
 }
 
-/* ---------- thread wrapper ---------- */
-void *thread(void *vargp)
+/* ---------- worker pool ---------- */
+void pool_init(pool_t *pp, int minthreads, int maxthreads, int depth)
 {
-  int connfd = *((int *)vargp);
+  pthread_t tid;
+
+  sbuf_init(&pp->sbuf, depth);
+  pthread_mutex_init(&pp->lock, NULL);
+  pp->nthreads = 0;
+  pp->minthreads = minthreads;
+  pp->maxthreads = maxthreads;
+  pp->busy = 0;
+  pool_spawn(pp, minthreads);
+  if (maxthreads > minthreads)
+    Pthread_create(&tid, NULL, pool_manager, pp);
+}
+
+/* start n more workers */
+void pool_spawn(pool_t *pp, int n)
+{
+  pthread_t tid;
+  int i;
+
+  for (i = 0; i < n; i++)
+    Pthread_create(&tid, &worker_attr, worker, pp);
+  pthread_mutex_lock(&pp->lock);
+  pp->nthreads += n;
+  pthread_mutex_unlock(&pp->lock);
+}
+
+/* worker: serve connections from the queue until told to retire */
+void *worker(void *vargp)
+{
+  pool_t *pp = (pool_t *)vargp;
+  txn_t *t = Malloc(sizeof(txn_t));
+  int connfd;
+
   Pthread_detach(pthread_self());
-  Free(vargp);
-  doit(connfd);
-  Close(connfd);
+  while (1)
+  {
+    connfd = sbuf_remove(&pp->sbuf);
+    if (connfd < 0) /* retirement token from pool_manager */
+    {
+      Free(t);
+      return NULL;
+    }
+
+    pthread_mutex_lock(&pp->lock);
+    pp->busy++;
+    pthread_mutex_unlock(&pp->lock);
+
+    serve_client(t, connfd);
+    Close(connfd);
+
+    pthread_mutex_lock(&pp->lock);
+    pp->busy--;
+    pthread_mutex_unlock(&pp->lock);
+  }
+}
+
+/*
+ * pool_manager: resize the pool from queue occupancy. Doubles the
+ * workers whenever connections are waiting and every worker is busy;
+ * halves them after POOL_IDLE_TICKS samples with an empty queue and
+ * under a quarter of the workers busy. Shrinking enqueues -1 tokens,
+ * so a worker only retires between connections.
+ */
+void *pool_manager(void *vargp)
+{
+  pool_t *pp = (pool_t *)vargp;
+  int queued, n, busy, delta, idle_ticks = 0;
+
+  Pthread_detach(pthread_self());
+  while (1)
+  {
+    usleep(POOL_TICK_USEC);
+    queued = sbuf_count(&pp->sbuf);
+
+    pthread_mutex_lock(&pp->lock);
+    n = pp->nthreads;
+    busy = pp->busy;
+    pthread_mutex_unlock(&pp->lock);
+
+    if (queued > 0 && busy >= n && n < pp->maxthreads)
+    {
+      idle_ticks = 0;
+      delta = (2 * n > pp->maxthreads) ? pp->maxthreads - n : n;
+      printf("[Pool] grow %d -> %d (queued=%d)\n", n, n + delta, queued);
+      pool_spawn(pp, delta);
+    }
+    else if (queued == 0 && busy < n / 4 && n > pp->minthreads)
+    {
+      if (++idle_ticks < POOL_IDLE_TICKS)
+        continue;
+      idle_ticks = 0;
+      delta = (n / 2 < pp->minthreads) ? n - pp->minthreads : n / 2;
+      printf("[Pool] shrink %d -> %d\n", n, n - delta);
+      pthread_mutex_lock(&pp->lock);
+      pp->nthreads -= delta;
+      pthread_mutex_unlock(&pp->lock);
+      while (delta-- > 0)
+        sbuf_insert(&pp->sbuf, -1);
+    }
+    else
+      idle_ticks = 0;
+  }
   return NULL;
 }
 
-/* ---------- doit: handle one HTTP request/response transaction ---------- */
-void doit(int connfd)
+/* ---------- client connections ---------- */
+/*
+ * Serve requests on one client connection until the client or a
+ * response ends it, it sits idle for conf.idle_sec, or conf.maxreqs
+ * requests have been served. Pipelined requests simply wait in
+ * t->client_rio's buffer and are answered in order.
+ */
+void serve_client(txn_t *t, int connfd)
 {
-  char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-  char hostname[MAXLINE], pathname[MAXLINE];
-  int port;
+  struct timeval tv;
+  int nreqs = 0;
 
-  rio_t client_rio;
+  tv.tv_sec = conf.idle_sec;
+  tv.tv_usec = 0;
+  setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
 
-  /* Read request line from client */
-  Rio_readinitb(&client_rio, connfd);
-  if (Rio_readlineb(&client_rio, buf, MAXLINE) <= 0)
-    return;
+  t->connfd = connfd;
+  Rio_readinitb(&t->client_rio, connfd);
+  while (++nreqs <= conf.maxreqs && doit(t, nreqs == conf.maxreqs))
+    ;
+}
+
+/* ---------- doit: handle one HTTP request/response transaction ---------- */
+/*
+ * last: this is the final request allowed on the connection. Returns
+ * 1 if the connection can carry another request, 0 to close it.
+ */
+int doit(txn_t *t, int last)
+{
+  char *method, *uri, *version, *save;
+  http_span_t line;
+  int n, port, keepalive, connfd = t->connfd;
+
+  /* Read request line from client (tolerating stray CRLFs between requests) */
+  while ((n = http_read_line(&t->client_rio, &line)) > 0 && http_is_blank(&line))
+    ;
+  if (n <= 0 || line.len >= MAXLINE) /* closed, failed or idle too long */
+    return 0;
+  memcpy(t->line, line.p, line.len); /* the one line parse_uri gets to edit */
+  t->line[line.len] = '\0';
 
-  printf("Request: %s", buf);
-  sscanf(buf, "%s %s %s", method, uri, version);
+  printf("Request: %s", t->line);
+  if ((method = strtok_r(t->line, " \t\r\n", &save)) == NULL ||
+      (uri = strtok_r(NULL, " \t\r\n", &save)) == NULL)
+    return 0;
+  if ((version = strtok_r(NULL, " \t\r\n", &save)) == NULL)
+    version = "";
 
   if (strcasecmp(method, "GET"))
   {
     printf("Proxy does not implement method %s\n", method);
-    return;
+    return 0;
   }
 
   /* Parse URI first */
-  if (parse_uri(uri, hostname, pathname, &port) < 0)
+  if (parse_uri(uri, t->hostname, t->pathname, &port) < 0)
   {
     printf("parse_uri failed for uri=%s\n", uri);
-    return;
+    return 0;
   }
-  printf("Parsed: host=%s path=%s port=%d\n", hostname, pathname, port);
+  printf("Parsed: host=%s path=%s port=%d\n", t->hostname, t->pathname, port);
+
+  /* Build the origin request; this consumes the client's headers */
+  int hdr_len = build_http_header(t->request, t->hostname, t->pathname, version, &t->client_rio,
+                                  &keepalive);
+  if (hdr_len < 0)
+    return 0;
+  keepalive = keepalive && !last;
 
   /* Cache key: host + path */
-  char cache_key[MAXLINE];
-  sprintf(cache_key, "%s%s", hostname, pathname);
+  sprintf(t->cache_key, "%s%s", t->hostname, t->pathname);
 
-  /* Try cache */
-  char *cached_buf = NULL;
+  /*
+   * Try cache: on a hit, write straight from the shared object. If
+   * another thread is already fetching this key we wait for its
+   * result; otherwise we may become the leader of the fetch.
+   */
+  const char *cached_buf = NULL;
   int cached_size = 0;
-  if (cache_get(cache_key, &cached_buf, &cached_size))
+  cache_flight_t *flight;
+  cache_obj_t *hit = cache_get_or_lead(t->cache_key, &cached_buf, &cached_size, &flight);
+  if (hit)
   {
-    Rio_writen(connfd, cached_buf, cached_size);
-    Free(cached_buf);
-    return;
+    keepalive = send_cached(connfd, cached_buf, cached_size, keepalive);
+    cache_release(hit);
+    return keepalive;
   }
 
-  /* Connect to origin server */
+  /*
+   * Send it over a pooled keep-alive connection if the origin has one
+   * parked. The origin may have closed that socket just before we
+   * used it, so a reused socket that yields no response at all is
+   * retried once on a fresh connection. A failure must not take the
+   * proxy down.
+   */
   char port_str[8];
   snprintf(port_str, sizeof(port_str), "%d", port);
-  int serverfd = Open_clientfd(hostname, port_str);
-  if (serverfd < 0)
+  int serverfd, reused, rc = -1;
+  do
   {
-    printf("Open_clientfd failed to %s:%s\n", hostname, port_str);
-    return;
-  }
-
-  /* Build header and send to server */
-  char http_header[MAXLINE];
-  build_http_header(http_header, hostname, pathname, &client_rio);
+    if ((serverfd = upstream_connect(t->hostname, port_str, &reused)) < 0)
+    {
+      printf("open_clientfd failed to %s:%s\n", t->hostname, port_str);
+      break;
+    }
+    Rio_readinitb(&t->server_rio, serverfd);
+    rc = -1;
+    if (rio_writen(serverfd, t->request, hdr_len) == hdr_len)
+      rc = forward_request_and_maybe_cache(t, flight, &keepalive);
+    if (rc > 0)
+      upstream_release(t->hostname, port_str, serverfd);
+    else
+      Close(serverfd);
+  } while (rc < 0 && reused);
 
-  rio_t server_rio;
-  Rio_readinitb(&server_rio, serverfd);
-  Rio_writen(serverfd, http_header, strlen(http_header));
+  if (serverfd < 0 || rc < 0)
+  {
+    if (flight)
+      cache_flight_abandon(flight);
+    return 0;
+  }
+  return keepalive;
+}
 
-  /* Forward response and maybe cache */
-  forward_request_and_maybe_cache(serverfd, &server_rio, connfd, cache_key);
+/*
+ * Write a cached response with a Connection header for this client.
+ * Cached objects carry no hop-by-hop headers, so the line goes in just
+ * before the empty line ending the header: the object's two halves and
+ * the line are gathered into one writev. Returns whether the
+ * connection stays open.
+ */
+int send_cached(int connfd, const char *buf, int size, int keepalive)
+{
+  const char *conn = keepalive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+  const char *end = memmem(buf, size, "\r\n\r\n", 4);
+  rio_iov_t out;
 
-  Close(serverfd);
+  /* a response without a header end goes out as is, and the connection with it */
+  if (end == NULL)
+  {
+    rio_writen(connfd, (void *)buf, size);
+    return 0;
+  }
+  rio_iovinit(&out);
+  rio_iovadd(&out, buf, end + 2 - buf);
+  rio_iovputs(&out, conn);
+  rio_iovadd(&out, end + 4, size - (end + 4 - buf));
+  if (rio_writev(connfd, out.iov, out.iov_cnt) < 0)
+    return 0;
+  return keepalive;
 }
 
 /* ---------- URI parsing (http://host[:port]/path) ---------- */
@@ -177,6 +671,10 @@ int parse_uri(char *uri, char *hostname, char *pathname, int *port)
     strcpy(pathname, "/");
   }
 
+  /* no real host name comes close; this bounds the hostname buffers */
+  if (strlen(hostbegin) >= NI_MAXHOST)
+    return -1;
+
   /* check for port */
   hostend = strchr(hostbegin, ':');
   if (hostend)
@@ -195,285 +693,464 @@ int parse_uri(char *uri, char *hostname, char *pathname, int *port)
 }
 
 /* ---------- build request header to origin ---------- */
-void build_http_header(char *http_header, char *hostname, char *pathname, rio_t *client_rio)
+/*
+ * Read the client's header fields and build the origin request.
+ * *keepalive_ptr says whether the client wants its connection kept
+ * open: HTTP/1.1 does unless it sends Connection: close, HTTP/1.0
+ * only with Connection: keep-alive. A request body would desync the
+ * connection, so its presence forces a close. Fields are parsed in
+ * place in client_rio's buffer and kept lines copied once, straight
+ * into http_header. Returns the request's length, or -1 if the client
+ * closed or stalled mid-header.
+ */
+int build_http_header(char *http_header, char *hostname, char *pathname, char *version,
+                      rio_t *client_rio, int *keepalive_ptr)
 {
-  char buf[MAXLINE], request_hdr[MAXLINE], host_hdr[MAXLINE], other_hdr[MAXLINE];
-  char line[MAXLINE];
-
-  /* Request line */
-  sprintf(request_hdr, "GET %s HTTP/1.0\r\n", pathname);
+  http_field_t f;
+  int len, rc, keepalive = !strcasecmp(version, "HTTP/1.1");
 
-  /* Host header */
-  sprintf(host_hdr, "Host: %s\r\n", hostname);
-
-  /* Read client headers and keep those we want (but not Connection/Proxy-Connection/User-Agent) */
-  other_hdr[0] = '\0';
-  Rio_readlineb(client_rio, line, MAXLINE); /* we've already read request line; now read headers */
-  while (strcmp(line, "\r\n"))
+  len = start_http_header(http_header, hostname, pathname, 1);
+  while ((rc = http_read_field(client_rio, &f)) > 0)
   {
-    if (!strncasecmp(line, "Host:", 5))
-    {
-      /* ignore, we'll add our own Host header */
-    }
-    else if (!strncasecmp(line, "Connection:", 11))
-    {
-      /* ignore */
-    }
-    else if (!strncasecmp(line, "Proxy-Connection:", 17))
-    {
-      /* ignore */
-    }
-    else if (!strncasecmp(line, "User-Agent:", 11))
+    switch (f.id)
     {
-      /* ignore: use our own */
-    }
-    else
-    {
-      strcat(other_hdr, line);
+    case HTTP_HDR_CONNECTION:
+    case HTTP_HDR_PROXY_CONNECTION:
+      if (http_span_has(&f.value, "close"))
+        keepalive = 0;
+      else if (http_span_has(&f.value, "keep-alive"))
+        keepalive = 1;
+      break;
+    case HTTP_HDR_TRANSFER_ENCODING:
+      keepalive = 0;
+      break;
+    case HTTP_HDR_CONTENT_LENGTH:
+      if (http_span_tol(&f.value) > 0)
+        keepalive = 0;
+      break;
+    default:
+      break;
     }
-    Rio_readlineb(client_rio, line, MAXLINE);
+    len = add_client_header(http_header, len, &f);
   }
+  if (rc < 0)
+    return -1;
 
-  /* Other headers: connection and user-agent fixed */
-  sprintf(other_hdr + strlen(other_hdr),
-          "Connection: close\r\n"
-          "Proxy-Connection: close\r\n"
-          "%s"
-          "\r\n",
-          user_agent_hdr);
-
-  /* Combine */
-  sprintf(http_header, "%s%s%s", request_hdr, host_hdr, other_hdr);
+  *keepalive_ptr = keepalive;
+  return finish_http_header(http_header, len, 1);
 }
 
-/* ---------- forward response and maybe cache ---------- */
-void forward_request_and_maybe_cache(int serverfd, rio_t *server_rio, int connfd, char *uri)
+/*
+ * request line + Host; keepalive asks for HTTP/1.1 persistence so the
+ * socket can be pooled
+ */
+int start_http_header(char *http_header, const char *hostname, const char *pathname,
+                      int keepalive)
 {
-  char buf[MAXLINE];
-  char hdr[MAXLINE * 4];
-  int hdr_len = 0;
-  ssize_t n;
+  int n = snprintf(http_header, MAXLINE - HEADER_TAIL_ROOM, "GET %s HTTP/1.%d\r\nHost: %s\r\n",
+                   pathname, keepalive, hostname);
 
-  /* 1) Read response headers from server, store into hdr buffer */
-  hdr_len = 0;
-  /* Read status line */
-  if ((n = Rio_readlineb(server_rio, buf, MAXLINE)) <= 0)
-    return;
-  memcpy(hdr + hdr_len, buf, n);
-  hdr_len += n;
+  return n < MAXLINE - HEADER_TAIL_ROOM ? n : MAXLINE - HEADER_TAIL_ROOM - 1;
+}
 
-  /* Read header lines until CRLF */
-  int content_length = -1;
-  while ((n = Rio_readlineb(server_rio, buf, MAXLINE)) > 0)
+/*
+ * append one client header line unless we replace it ourselves. No
+ * request body is ever forwarded, so its framing headers are dropped:
+ * passed on, they would leave a pooled origin waiting for a body, or
+ * reading the next request as one.
+ */
+int add_client_header(char *http_header, int len, const http_field_t *f)
+{
+  switch (f->id)
   {
-    memcpy(hdr + hdr_len, buf, n);
-    hdr_len += n;
-    /* parse Content-length */
-    if (!strncasecmp(buf, "Content-length:", 15))
-    {
-      content_length = atoi(buf + 15);
-    }
-    if (strcmp(buf, "\r\n") == 0)
-      break;
+  case HTTP_HDR_HOST: /* we'll add our own Host header */
+  case HTTP_HDR_CONNECTION:
+  case HTTP_HDR_PROXY_CONNECTION:
+  case HTTP_HDR_USER_AGENT: /* use our own */
+  case HTTP_HDR_CONTENT_LENGTH:
+  case HTTP_HDR_TRANSFER_ENCODING:
+    return len;
+  default:
+    break;
   }
 
-  /* If no Content-length, we will read until EOF (but caching only if total <= MAX_OBJECT_SIZE) */
-  /* send headers to client first */
-  Rio_writen(connfd, hdr, hdr_len);
+  /* leave room in the request for the fixed headers */
+  if (len + f->line.len >= MAXLINE - HEADER_TAIL_ROOM)
+    return len;
+  memcpy(http_header + len, f->line.p, f->line.len);
+  return len + f->line.len;
+}
+
+/* fixed connection/user-agent headers and the empty line */
+int finish_http_header(char *http_header, int len, int keepalive)
+{
+  return len + snprintf(http_header + len, MAXLINE - len, "%s%s\r\n",
+                        keepalive ? "Connection: keep-alive\r\n"
+                                  : "Connection: close\r\nProxy-Connection: close\r\n",
+                        user_agent_hdr);
+}
+
+/* ---------- forward response and maybe cache ---------- */
+/*
+ * Relay the response to the client in MAXBUF chunks while capturing a
+ * copy for the cache in a single cache-owned buffer. The copy is
+ * dropped as soon as it outgrows the cache's object cap (or up front for a
+ * response response_cacheable() turns away), so memory per transfer
+ * stays bounded however large the body is, and from then on the body
+ * is spliced socket to socket. A client that
+ * goes away, or an origin that truncates the body, costs only this
+ * transaction.
+ *
+ * The body is framed by Content-length, by chunked encoding (decoded
+ * here, so clients and the cache see a plain body) or by EOF. The
+ * hop-by-hop Connection, Keep-Alive and Transfer-Encoding headers are
+ * not passed on; the client gets its own Connection header instead.
+ * A decoded or EOF-framed body has no length to give the client, so
+ * that connection is closed, but the cached copy gains a
+ * Content-length and later hits can stay persistent.
+ *
+ * *keepalive_ptr is whether the client may keep its connection on
+ * entry, and whether it actually can once the response is out.
+ *
+ * Returns -1 if the origin sent no response at all (flight is left
+ * untouched for the caller to retry or abandon). Otherwise flight, if
+ * non-NULL, is resolved, and the return value is 1 if the origin
+ * socket was read to the exact end of a persistent response and may
+ * be pooled, 0 if it must be closed.
+ */
+int forward_request_and_maybe_cache(txn_t *t, cache_flight_t *flight, int *keepalive_ptr)
+{
+  rio_t *server_rio = &t->server_rio;
+  char *hdr = t->hdr, *uri = t->cache_key;
+  int n, hdr_len = 0, hdr_end, connfd = t->connfd;
+  long content_length = -1;
+  http_span_t line;
+  http_field_t f;
+  rio_iov_t out;
+  cache_fill_t fill;
+  int client_ok = 1, complete, keepalive = 0, chunked = 0, status = 0, minor = 0, first = 1;
+  int nostore = 0;
+  const char *conn;
+
+  cache_fill_init(&fill);
+  *keepalive_ptr = *keepalive_ptr != 0;
 
-  /* 2) Read body */
-  /* If content_length >= 0, read that many bytes; else read until EOF */
-  char *body = NULL;
-  int body_len = 0;
-  if (content_length >= 0)
+  /* 1) status line and headers, sent to the client in as few writes as fit hdr */
+  while ((n = http_read_line(server_rio, &line)) > 0 && !http_is_blank(&line))
   {
-    if (content_length > 0)
+    if (first)
     {
-      body = Malloc(content_length);
-      int remain = content_length;
-      char *p = body;
-      while (remain > 0)
-      {
-        n = Rio_readnb(server_rio, p, remain);
-        if (n <= 0)
-          break;
-        p += n;
-        remain -= n;
-      }
-      body_len = content_length - remain;
-      /* forward body to client */
-      if (body_len > 0)
-        Rio_writen(connfd, body, body_len);
+      /* HTTP/1.1 persists unless told otherwise; HTTP/1.0 only if asked */
+      if (http_parse_status(&line, &minor, &status) == 0)
+        keepalive = (minor >= 1);
+      first = 0;
     }
-  }
-  else
-  {
-    /* read until EOF */
-    /* accumulate into a dynamic buffer in chunks */
-    int cap = 8192;
-    body = Malloc(cap);
-    body_len = 0;
-    while ((n = Rio_readnb(server_rio, buf, MAXLINE)) > 0)
+    else
     {
-      if (body_len + n > cap)
+      http_parse_field(&line, &f);
+      switch (f.id)
       {
-        while (body_len + n > cap)
-          cap *= 2;
-        body = Realloc(body, cap);
+      case HTTP_HDR_CONTENT_LENGTH:
+        content_length = http_span_tol(&f.value);
+        break;
+      case HTTP_HDR_TRANSFER_ENCODING:
+        chunked = http_span_has(&f.value, "chunked");
+        continue;
+      case HTTP_HDR_CONNECTION:
+        if (http_span_has(&f.value, "close"))
+          keepalive = 0;
+        else if (http_span_has(&f.value, "keep-alive"))
+          keepalive = 1;
+        continue;
+      case HTTP_HDR_KEEP_ALIVE:
+        continue;
+      case HTTP_HDR_CACHE_CONTROL:
+        if (http_span_has(&f.value, "no-store") || http_span_has(&f.value, "private"))
+          nostore = 1;
+        break;
+      default:
+        break;
       }
-      memcpy(body + body_len, buf, n);
-      body_len += n;
-      Rio_writen(connfd, buf, n);
     }
+
+    /* line points into server_rio's buffer; copy it out before the next read */
+    cache_fill_append(&fill, line.p, line.len);
+    if (hdr_len + line.len > MAXBUF)
+    {
+      client_ok = client_ok && rio_writen(connfd, hdr, hdr_len) == hdr_len;
+      hdr_len = 0;
+    }
+    memcpy(hdr + hdr_len, line.p, line.len);
+    hdr_len += line.len;
   }
+  if (n <= 0) /* origin closed or failed before finishing the header */
+  {
+    cache_fill_abandon(&fill);
+    *keepalive_ptr = 0;
+    if (first)
+      return -1;
+    if (flight)
+      cache_flight_abandon(flight);
+    return 0;
+  }
+
+  /* 1xx, 204 and 304 never carry a body */
+  if ((status >= 100 && status < 200) || status == 204 || status == 304)
+  {
+    chunked = 0;
+    content_length = 0;
+  }
+
+  /* the client can only keep its connection if it can find the body's end */
+  if (chunked || content_length < 0)
+    *keepalive_ptr = 0;
+  conn = *keepalive_ptr ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+  cache_fill_append(&fill, "\r\n", 2);
+  hdr_end = fill.len;
 
-  /* 3) Combine hdr + body into one object and cache if small enough */
-  int total_size = hdr_len + body_len;
-  if (total_size <= MAX_OBJECT_SIZE)
+  /*
+   * Too big or not allowed to cache: let any followers start their own
+   * fetch now, and splice the body instead of copying it.
+   */
+  if (!response_cacheable(status, nostore) ||
+      (!chunked && content_length > cache_max_object_size()))
+    cache_fill_abandon(&fill);
+  else if (!chunked && content_length > 0)
+    cache_fill_reserve(&fill, content_length);
+  if (flight && !fill.ok)
   {
-    char *objbuf = Malloc(total_size);
-    memcpy(objbuf, hdr, hdr_len);
-    if (body_len > 0)
-      memcpy(objbuf + hdr_len, body, body_len);
-    printf("[Cache Insert] URI=%s, size=%d\n", uri, total_size);
-    cache_put(uri, objbuf, total_size);
-    Free(objbuf);
+    cache_flight_abandon(flight);
+    flight = NULL;
   }
 
-  if (body)
-    Free(body);
+  /*
+   * The rest of the header, our Connection line and whatever plain
+   * body rio already read ahead go to the client in one writev.
+   */
+  rio_iovinit(&out);
+  rio_iovadd(&out, hdr, hdr_len);
+  rio_iovputs(&out, conn);
+  if (!chunked && content_length != 0 && server_rio->rio_cnt > 0)
+  {
+    n = server_rio->rio_cnt;
+    if (content_length > 0 && content_length < n)
+      n = content_length;
+    rio_iovadd(&out, server_rio->rio_bufptr, n);
+    cache_fill_append(&fill, server_rio->rio_bufptr, n);
+    server_rio->rio_bufptr += n;
+    server_rio->rio_cnt -= n;
+    if (content_length > 0)
+      content_length -= n;
+  }
+  client_ok = client_ok && rio_writev(connfd, out.iov, out.iov_cnt) >= 0;
+
+  /* 2) body; only an explicitly framed one leaves the socket reusable */
+  if (chunked)
+    complete = relay_chunked(server_rio, connfd, &client_ok, &fill);
+  else
+    complete = relay_body(server_rio, connfd, content_length, &client_ok, &fill);
+  if (!chunked && content_length < 0)
+    keepalive = 0;
+  if (!complete || !client_ok)
+    *keepalive_ptr = 0;
+
+  /* 3) hand the captured copy to the cache; never cache a truncated body */
+  if (!complete)
+    cache_fill_abandon(&fill);
+  else if (chunked || content_length < 0)
+    fill_add_content_length(&fill, hdr_end);
+  if (fill.ok)
+    printf("[Cache Insert] URI=%s, size=%d\n", uri, fill.len);
+  cache_fill_commit(&fill, uri, flight); /* wakes the followers */
+
+  return complete && keepalive;
 }
 
-/* ---------- cache implementation ---------- */
-void cache_init(void)
+/*
+ * the caching rule both engines apply once a response head is in: only
+ * a 200 the origin lets a shared cache store. Anything else, a 304 to
+ * one client's conditional request included, says nothing about what
+ * the next client should get.
+ */
+int response_cacheable(int status, int nostore)
 {
-  cache_head = cache_tail = NULL;
-  cache_total_size = 0;
-  pthread_mutex_init(&cache_lock, NULL);
+  return status == 200 && !nostore;
 }
 
-/* return 1 and set *buf_ptr (malloc'd copy) and *size_ptr if hit; else return 0 */
-int cache_get(const char *uri, char **buf_ptr, int *size_ptr)
+/* give a captured body of unknown length a Content-length header */
+void fill_add_content_length(cache_fill_t *fill, int hdr_end)
 {
-  pthread_mutex_lock(&cache_lock);
-  cache_obj_t *p = cache_head;
-  while (p)
+  char line[64];
+  int n, body_len = fill->len - hdr_end;
+
+  n = snprintf(line, sizeof(line), "Content-length: %d\r\n", body_len);
+  cache_fill_reserve(fill, n);
+  if (!fill->ok)
+    return;
+
+  /* insert in front of the empty line that ends the header */
+  memmove(fill->buf + hdr_end - 2 + n, fill->buf + hdr_end - 2, body_len + 2);
+  memcpy(fill->buf + hdr_end - 2, line, n);
+  fill->len += n;
+}
+
+/*
+ * relay len body bytes (len < 0: until EOF) to the client and the fill,
+ * straight out of server_rio's buffer. Once nothing is being captured
+ * for the cache, the rest is spliced. Returns 1 if the body arrived in
+ * full.
+ */
+int relay_body(rio_t *server_rio, int connfd, long len, int *client_ok, cache_fill_t *fill)
+{
+  ssize_t n;
+  int rc;
+
+  while (len != 0)
   {
-    if (strcmp(p->uri, uri) == 0)
+    if (!fill->ok)
     {
-      /* hit: move to head */
-      cache_move_to_head(p);
-      /* copy out */
-      *size_ptr = p->size;
-      *buf_ptr = Malloc(p->size);
-      memcpy(*buf_ptr, p->data, p->size);
-      pthread_mutex_unlock(&cache_lock);
-      return 1;
+      if (!*client_ok) /* nobody left to serve: stop pulling from the origin */
+        return 0;
+      if ((rc = relay_splice(server_rio, connfd, &len, client_ok)) >= 0)
+        return rc;
     }
-    p = p->next;
+
+    if (server_rio->rio_cnt <= 0 && (n = refill_rio(server_rio)) <= 0)
+      return n == 0 && len < 0;
+    n = server_rio->rio_cnt;
+    if (len >= 0 && len < n)
+      n = len;
+
+    if (*client_ok && rio_writen(connfd, server_rio->rio_bufptr, n) != n)
+      *client_ok = 0; /* keep filling the cache for the followers */
+    cache_fill_append(fill, server_rio->rio_bufptr, n);
+    server_rio->rio_bufptr += n;
+    server_rio->rio_cnt -= n;
+    if (len > 0)
+      len -= n;
   }
-  pthread_mutex_unlock(&cache_lock);
-  return 0;
+  return 1;
 }
 
-/* insert object into cache (evict as needed). copies uri and buf */
-void cache_put(const char *uri, const char *buf, int size)
+/* read into rp's empty buffer: bytes read, 0 at EOF, -1 on error or timeout */
+ssize_t refill_rio(rio_t *rp)
 {
-  if (size > MAX_OBJECT_SIZE)
-    return; /* don't cache oversize objects */
+  ssize_t n;
 
-  pthread_mutex_lock(&cache_lock);
+  while ((n = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf))) < 0 && errno == EINTR)
+    ;
+  rp->rio_bufptr = rp->rio_buf;
+  rp->rio_cnt = n > 0 ? n : 0;
+  return n;
+}
 
-  /* If already present, remove it first (we'll re-insert as MRU) */
-  cache_obj_t *p = cache_head;
-  while (p)
+/*
+ * Move *len_ptr body bytes (negative: until EOF) from the origin to the
+ * client through a pipe with splice(), so an uncacheable body never
+ * enters user space. Whatever rio already buffered goes out first.
+ * Each thread keeps its pipe; one left holding bytes after an error is
+ * replaced. Returns 1 if the body arrived in full, 0 if not, and -1 if
+ * the kernel cannot splice these sockets, with *len_ptr updated for
+ * the copy loop to finish the job.
+ */
+int relay_splice(rio_t *server_rio, int connfd, long *len_ptr, int *client_ok)
+{
+  static __thread int pipefd[2] = {-1, -1};
+  static int unsupported; /* shared by every worker; atomic accesses only */
+  long len = *len_ptr;
+  ssize_t n, m;
+  size_t want;
+
+  if (__atomic_load_n(&unsupported, __ATOMIC_RELAXED))
+    return -1;
+
+  /* bytes rio read ahead are already in user space */
+  if (server_rio->rio_cnt > 0)
   {
-    if (strcmp(p->uri, uri) == 0)
+    n = server_rio->rio_cnt;
+    if (len >= 0 && len < n)
+      n = len;
+    if (rio_writen(connfd, server_rio->rio_bufptr, n) != n)
     {
-      cache_remove(p);
-      cache_free_obj(p);
-      break;
+      *client_ok = 0;
+      return 0;
     }
-    p = p->next;
-  }
-
-  /* evict as needed */
-  cache_evict_if_needed(size);
-
-  /* create new object */
-  cache_obj_t *obj = Malloc(sizeof(cache_obj_t));
-  obj->uri = Malloc(strlen(uri) + 1);
-  strcpy(obj->uri, uri);
-  obj->data = Malloc(size);
-  memcpy(obj->data, buf, size);
-  obj->size = size;
-  obj->prev = obj->next = NULL;
-
-  /* insert at head (MRU) */
-  obj->next = cache_head;
-  if (cache_head)
-    cache_head->prev = obj;
-  cache_head = obj;
-  if (!cache_tail)
-    cache_tail = obj;
-  cache_total_size += size;
-
-  pthread_mutex_unlock(&cache_lock);
-}
+    server_rio->rio_bufptr += n;
+    server_rio->rio_cnt -= n;
+    if (len > 0)
+      len -= n;
+    *len_ptr = len;
+  }
 
-/* evict LRU until we have room for 'needed' bytes */
-void cache_evict_if_needed(int needed)
-{
-  while (cache_total_size + needed > MAX_CACHE_SIZE && cache_tail)
+  if (pipefd[0] < 0 && pipe(pipefd) < 0)
+    return -1;
+
+  while (len != 0)
   {
-    cache_obj_t *victim = cache_tail;
-    cache_remove(victim);
-    cache_total_size -= victim->size;
-    cache_free_obj(victim);
+    want = (len > 0 && len < SPLICE_CHUNK) ? len : SPLICE_CHUNK;
+    n = splice(server_rio->rio_fd, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EINVAL || errno == ENOSYS))
+    {
+      /* say so once; the copy loop takes over */
+      if (!__atomic_exchange_n(&unsupported, 1, __ATOMIC_RELAXED))
+        fprintf(stderr, "relay_splice: %s, copying instead\n", strerror(errno));
+      return -1;
+    }
+    if (n <= 0)
+      return n == 0 && len < 0;
+    if (len > 0)
+      len -= n;
+
+    /* drain the pipe to the client */
+    while (n > 0)
+    {
+      m = splice(pipefd[0], NULL, connfd, NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (m < 0 && errno == EINTR)
+        continue;
+      if (m <= 0)
+      {
+        *client_ok = 0;
+        close(pipefd[0]);
+        close(pipefd[1]);
+        pipefd[0] = pipefd[1] = -1;
+        return 0;
+      }
+      n -= m;
+    }
   }
+  return 1;
 }
 
-/* move existing node to head (MRU) */
-void cache_move_to_head(cache_obj_t *obj)
+/* decode a chunked body into a plain one; returns 1 if it ended properly */
+int relay_chunked(rio_t *server_rio, int connfd, int *client_ok, cache_fill_t *fill)
 {
-  if (obj == cache_head)
-    return;
-  /* unlink */
-  if (obj->prev)
-    obj->prev->next = obj->next;
-  if (obj->next)
-    obj->next->prev = obj->prev;
-  if (obj == cache_tail)
-    cache_tail = obj->prev;
-  /* insert at head */
-  obj->prev = NULL;
-  obj->next = cache_head;
-  if (cache_head)
-    cache_head->prev = obj;
-  cache_head = obj;
-}
+  http_span_t line;
+  char *end;
+  long size;
 
-/* remove obj from list (does not free) */
-void cache_remove(cache_obj_t *obj)
-{
-  if (!obj)
-    return;
-  if (obj->prev)
-    obj->prev->next = obj->next;
-  else
-    cache_head = obj->next;
-  if (obj->next)
-    obj->next->prev = obj->prev;
-  else
-    cache_tail = obj->prev;
-}
+  while (1)
+  {
+    /* chunk-size [; extensions] CRLF; the line's '\n' stops strtol */
+    if (http_read_line(server_rio, &line) <= 0)
+      return 0;
+    size = strtol(line.p, &end, 16);
+    if (end == line.p || size < 0)
+      return 0;
+    if (size == 0)
+      break;
+    if (!relay_body(server_rio, connfd, size, client_ok, fill))
+      return 0;
+    if (http_read_line(server_rio, &line) <= 0 || !http_is_blank(&line))
+      return 0;
+  }
 
-/* free node memory */
-void cache_free_obj(cache_obj_t *obj)
-{
-  if (!obj)
-    return;
-  Free(obj->uri);
-  Free(obj->data);
-  Free(obj);
+  /* trailer fields (dropped) up to the final empty line */
+  do
+  {
+    if (http_read_line(server_rio, &line) <= 0)
+      return 0;
+  } while (!http_is_blank(&line));
+  return 1;
 }
@@ -0,0 +1,22 @@
+/* proxy.h - declarations shared by the proxy's connection engines */
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include "http.h"
+#include "cache.h"
+
+/* request parsing / rewriting (proxy.c); lengths are returned, MAXLINE buffers */
+int parse_uri(char *uri, char *hostname, char *pathname, int *port);
+int start_http_header(char *http_header, const char *hostname, const char *pathname,
+                      int keepalive);
+int add_client_header(char *http_header, int len, const http_field_t *f);
+int finish_http_header(char *http_header, int len, int keepalive);
+
+/* response caching rule (proxy.c), shared so both engines agree */
+int response_cacheable(int status, int nostore);
+void fill_add_content_length(cache_fill_t *fill, int hdr_end); /* EOF-framed fills */
+
+/* epoll engine (event.c) */
+void event_loop(int listenfd);
+
+#endif /* __PROXY_H__ */
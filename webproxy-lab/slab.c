@@ -0,0 +1,233 @@
+/*
+ * slab.c - fixed-size arenas carved into chunks by size class
+ *
+ * An arena is one mmap'd region reserved when it is created, so its
+ * owner can never use more memory than that, and nothing is asked of
+ * malloc afterwards. A chunk is the caller's bytes behind a 16-byte
+ * header, rounded up to 16 bytes, so an allocation occupies at most 31
+ * bytes more than it asked for and the memory in use tracks the sizes
+ * actually stored.
+ *
+ * Free chunks sit on segregated lists, SLAB_CLASS_SPLIT size classes
+ * per power of two, with a bitmap of the lists that are not empty. A
+ * request takes the first chunk of the smallest class whose chunks are
+ * all big enough, falling back to the first few chunks of its own class,
+ * and the chunk's tail goes back on a free list as a chunk of its own.
+ * A freed chunk merges with whichever neighbours are free too (each
+ * header records the size of the chunk before it), so memory given
+ * back by one size class is available to all the others instead of
+ * stranded in it.
+ *
+ * Headers live in the arena; used chunks otherwise belong entirely to
+ * the caller. Every call takes the arena's lock.
+ */
+#include "csapp.h"
+#include "slab.h"
+#include <stdint.h>
+
+#define SLAB_MAX_SHIFT 40     /* larger chunks all share the top class */
+#define SLAB_CLASS_SPLIT 4    /* size classes per power of two */
+#define SLAB_NCLASSES ((SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1) * SLAB_CLASS_SPLIT)
+#define SLAB_FREE 1           /* size flag: the chunk is on a free list */
+#define SLAB_FIT_TRIES 8      /* chunks of need's own class looked at before giving up */
+
+/* in front of every chunk; sizes include the header and are multiples of SLAB_GRAIN */
+typedef struct
+{
+  size_t size; /* this chunk, | SLAB_FREE while it is free */
+  size_t prev; /* the chunk just below it, 0 for the first */
+} slab_hdr_t;
+
+/* free chunks are linked just past their headers */
+typedef struct slab_chunk
+{
+  struct slab_chunk *prev;
+  struct slab_chunk *next;
+} slab_chunk_t;
+
+#define SLAB_MIN_CHUNK (sizeof(slab_hdr_t) + sizeof(slab_chunk_t))
+
+struct slab
+{
+  pthread_mutex_t lock;
+  char *base;
+  size_t size; /* usable bytes, a multiple of SLAB_GRAIN */
+  uint64_t map[(SLAB_NCLASSES + 63) / 64]; /* bit j: free[j] is not empty */
+  slab_chunk_t *free[SLAB_NCLASSES];
+};
+
+static int slab_class(size_t size);
+static slab_hdr_t *slab_find(slab_t *s, size_t need);
+static void slab_push(slab_t *s, slab_hdr_t *h, size_t size);
+static void slab_remove(slab_t *s, slab_hdr_t *h);
+static void slab_set_prev(slab_t *s, slab_hdr_t *h);
+
+#define SLAB_SIZE(h) ((h)->size & ~(size_t)SLAB_FREE)
+#define SLAB_NEXT(h) ((slab_hdr_t *)((char *)(h) + SLAB_SIZE(h)))
+#define SLAB_LINKS(h) ((slab_chunk_t *)((h) + 1))
+
+/* ---------- public interface ---------- */
+slab_t *slab_create(size_t size)
+{
+  slab_t *s = Calloc(1, sizeof(slab_t));
+  slab_hdr_t *h;
+
+  pthread_mutex_init(&s->lock, NULL);
+  s->size = size & ~(size_t)(SLAB_GRAIN - 1);
+  if (s->size < SLAB_MIN_CHUNK)
+  {
+    s->size = 0;
+    return s;
+  }
+  s->base = Mmap(NULL, s->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  /* the whole arena starts out as one free chunk */
+  h = (slab_hdr_t *)s->base;
+  h->prev = 0;
+  slab_push(s, h, s->size);
+  return s;
+}
+
+void *slab_alloc(slab_t *s, size_t n)
+{
+  size_t need = slab_chunk_size(n), size;
+  slab_hdr_t *h, *rest;
+
+  if (n > slab_largest(s))
+    return NULL;
+  pthread_mutex_lock(&s->lock);
+  if ((h = slab_find(s, need)) == NULL)
+  {
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+  }
+  slab_remove(s, h);
+  size = SLAB_SIZE(h);
+
+  /* hand back a tail big enough to be a chunk; its upper neighbour is in use */
+  if (size - need >= SLAB_MIN_CHUNK)
+  {
+    rest = (slab_hdr_t *)((char *)h + need);
+    rest->prev = need;
+    slab_push(s, rest, size - need);
+    slab_set_prev(s, rest);
+    size = need;
+  }
+  h->size = size;
+  pthread_mutex_unlock(&s->lock);
+  return h + 1;
+}
+
+void slab_free(slab_t *s, void *ptr)
+{
+  slab_hdr_t *h = (slab_hdr_t *)ptr - 1, *next, *prev;
+  size_t size;
+
+  pthread_mutex_lock(&s->lock);
+  size = SLAB_SIZE(h);
+  next = SLAB_NEXT(h);
+  if ((char *)next < s->base + s->size && (next->size & SLAB_FREE))
+  {
+    slab_remove(s, next);
+    size += SLAB_SIZE(next);
+  }
+  if (h->prev != 0 && ((prev = (slab_hdr_t *)((char *)h - h->prev))->size & SLAB_FREE))
+  {
+    slab_remove(s, prev);
+    size += SLAB_SIZE(prev);
+    h = prev;
+  }
+  slab_push(s, h, size);
+  slab_set_prev(s, h);
+  pthread_mutex_unlock(&s->lock);
+}
+
+size_t slab_chunk_size(size_t n)
+{
+  size_t need = (n + sizeof(slab_hdr_t) + SLAB_GRAIN - 1) & ~(size_t)(SLAB_GRAIN - 1);
+
+  return need < SLAB_MIN_CHUNK ? SLAB_MIN_CHUNK : need;
+}
+
+size_t slab_largest(slab_t *s)
+{
+  return s->size ? s->size - sizeof(slab_hdr_t) : 0;
+}
+
+/* ---------- free lists ---------- */
+/* class of a chunk of size bytes: its power of two, then which quarter of it */
+static int slab_class(size_t size)
+{
+  int k = 63 - __builtin_clzll(size), c;
+
+  if (k > SLAB_MAX_SHIFT)
+    return SLAB_NCLASSES - 1;
+  c = (k - SLAB_MIN_SHIFT) * SLAB_CLASS_SPLIT + (int)((size >> (k - 2)) & (SLAB_CLASS_SPLIT - 1));
+  return c < 0 ? 0 : c;
+}
+
+/* lock held: a free chunk of at least need bytes, or NULL */
+static slab_hdr_t *slab_find(slab_t *s, size_t need)
+{
+  int k = 63 - __builtin_clzll(need), c = slab_class(need), j;
+  slab_chunk_t *p;
+  uint64_t bits;
+  int tries = 0;
+
+  /* every chunk of a class above need's own is big enough */
+  j = c + 1;
+  if (k <= SLAB_MAX_SHIFT && (need & (((size_t)1 << (k - 2)) - 1)) == 0)
+    j = c; /* need is the class's lower bound */
+  for (; j < SLAB_NCLASSES; j = (j | 63) + 1)
+  {
+    bits = s->map[j >> 6] >> (j & 63);
+    if (bits)
+    {
+      j += __builtin_ctzll(bits);
+      return (slab_hdr_t *)s->free[j] - 1;
+    }
+  }
+
+  /* then the first few in need's class, in case one happens to fit */
+  for (p = s->free[c]; p && tries++ < SLAB_FIT_TRIES; p = p->next)
+    if (SLAB_SIZE((slab_hdr_t *)p - 1) >= need)
+      return (slab_hdr_t *)p - 1;
+  return NULL;
+}
+
+static void slab_push(slab_t *s, slab_hdr_t *h, size_t size)
+{
+  slab_chunk_t *c = SLAB_LINKS(h);
+  int j = slab_class(size);
+
+  h->size = size | SLAB_FREE;
+  c->prev = NULL;
+  c->next = s->free[j];
+  if (c->next)
+    c->next->prev = c;
+  s->free[j] = c;
+  s->map[j >> 6] |= (uint64_t)1 << (j & 63);
+}
+
+static void slab_remove(slab_t *s, slab_hdr_t *h)
+{
+  slab_chunk_t *c = SLAB_LINKS(h);
+  int j = slab_class(SLAB_SIZE(h));
+
+  if (c->prev)
+    c->prev->next = c->next;
+  else if ((s->free[j] = c->next) == NULL)
+    s->map[j >> 6] &= ~((uint64_t)1 << (j & 63));
+  if (c->next)
+    c->next->prev = c->prev;
+  h->size = SLAB_SIZE(h);
+}
+
+/* tell the chunk above h how far back h starts */
+static void slab_set_prev(slab_t *s, slab_hdr_t *h)
+{
+  slab_hdr_t *next = SLAB_NEXT(h);
+
+  if ((char *)next < s->base + s->size)
+    next->prev = SLAB_SIZE(h);
+}
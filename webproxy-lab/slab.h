@@ -0,0 +1,18 @@
+/* slab.h - fixed-size arenas carved into chunks by size class */
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <stddef.h>
+
+#define SLAB_GRAIN 16    /* chunk sizes are multiples of this */
+#define SLAB_MIN_SHIFT 5 /* smallest chunk: 32 bytes */
+
+typedef struct slab slab_t;
+
+slab_t *slab_create(size_t size); /* reserves size bytes up front */
+void *slab_alloc(slab_t *s, size_t n); /* NULL if no free chunk is big enough */
+void slab_free(slab_t *s, void *p);
+size_t slab_chunk_size(size_t n); /* bytes an n-byte allocation occupies */
+size_t slab_largest(slab_t *s);   /* biggest allocation the arena can ever serve */
+
+#endif /* __SLAB_H__ */
@@ -0,0 +1,94 @@
+/*
+ * cgi.c - worker side of Tiny's persistent CGI protocol (../cgipool.c)
+ *
+ * Tiny starts a worker with its first request already in place, as for
+ * plain CGI, and the worker's stdin connected to Tiny. Finishing a
+ * request means flushing stdout, pointing it away from the client and
+ * sending Tiny one byte; the next request then arrives as one message
+ * carrying the environment and, attached, the client connection.
+ */
+#include "csapp.h"
+#include "../cgipool.h"
+#include "cgi.h"
+
+static int nrequests;
+static char env[CGIPOOL_MAX_REQUEST]; /* the current request's variables */
+static int envlen;
+
+static void cgi_finish(void);
+static int cgi_next(void);
+
+int cgi_accept(void)
+{
+  if (getenv(CGIPOOL_WORKER_ENV) == NULL)
+    return nrequests++ == 0 ? 0 : -1; /* plain CGI: one request */
+
+  if (nrequests++ == 0)
+    return 0; /* started with this one */
+  cgi_finish();
+  return cgi_next();
+}
+
+/* let go of the client and tell Tiny the response is complete */
+static void cgi_finish(void)
+{
+  static int nullfd = -1;
+  char c = 0;
+
+  fflush(stdout);
+  if (nullfd < 0)
+    nullfd = open("/dev/null", O_WRONLY);
+  dup2(nullfd, STDOUT_FILENO);
+  while (send(STDIN_FILENO, &c, 1, MSG_NOSIGNAL) < 0 && errno == EINTR)
+    ;
+}
+
+/* wait for the next request; -1 when Tiny has closed the socket */
+static int cgi_next(void)
+{
+  char cbuf[CMSG_SPACE(sizeof(int))], *p, *eq;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct iovec iov;
+  ssize_t n;
+  int connfd = -1;
+
+  /* drop the previous request's variables */
+  for (p = env; p < env + envlen; p += strlen(p) + 1)
+    if ((eq = strchr(p, '=')) != NULL)
+    {
+      *eq = '\0';
+      unsetenv(p);
+    }
+  envlen = 0;
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = env;
+  iov.iov_len = sizeof(env) - 1;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+  while ((n = recvmsg(STDIN_FILENO, &msg, 0)) < 0 && errno == EINTR)
+    ;
+  if (n <= 0)
+    return -1;
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+      memcpy(&connfd, CMSG_DATA(cmsg), sizeof(int));
+  if (connfd < 0)
+    return -1;
+  dup2(connfd, STDOUT_FILENO);
+  close(connfd);
+
+  env[n] = '\0';
+  envlen = n;
+  for (p = env; p < env + envlen; p += strlen(p) + 1)
+    if ((eq = strchr(p, '=')) != NULL)
+    {
+      *eq = '\0';
+      setenv(p, eq + 1, 1);
+      *eq = '='; /* kept whole so the names can be unset next time */
+    }
+  return 0;
+}
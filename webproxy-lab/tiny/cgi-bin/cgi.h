@@ -0,0 +1,21 @@
+/*
+ * cgi.h - run a CGI program either once per request or as a
+ *     persistent Tiny worker (see ../cgipool.c)
+ *
+ * Wrap the body of main in
+ *
+ *     while (cgi_accept() >= 0)
+ *     {
+ *       ... read QUERY_STRING, print the response to stdout ...
+ *     }
+ *
+ * Forked per request, the loop runs once. As a worker it runs once per
+ * request until Tiny goes away; each time round, QUERY_STRING and stdout
+ * belong to the current request.
+ */
+#ifndef __CGI_H__
+#define __CGI_H__
+
+int cgi_accept(void); /* 0: a request is ready; -1: no more requests */
+
+#endif /* __CGI_H__ */
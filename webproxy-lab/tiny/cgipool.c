@@ -0,0 +1,361 @@
+/*
+ * cgipool.c - CGI processes: persistent worker pools and one-shot children
+ *
+ * Instead of a fork and exec per /cgi-bin request, a program runs as
+ * up to nworkers long-lived processes, in the spirit of FastCGI. Each
+ * worker talks to Tiny over its own SOCK_SEQPACKET socket, which it
+ * finds on its standard input:
+ *
+ *   request  one message: the CGI environment as "NAME=value\0..." with
+ *            the client connection attached (SCM_RIGHTS)
+ *   reply    one byte once the response is written and the worker has
+ *            let go of the connection
+ *
+ * The worker writes the response to the client itself, exactly as a
+ * one-shot CGI child does, so nothing is copied through Tiny. Workers are
+ * started on demand, with the request that caused the start passed the
+ * classic way (QUERY_STRING set, stdout on the client), so the first
+ * request costs what it always did. A program that exits normally
+ * without replying is plain CGI; it is remembered and run per
+ * request from then on. cgi-bin/cgi.c is the worker side of all this.
+ *
+ * A worker that dies is reaped and replaced by the next request. One
+ * lock covers every pool; it is never held across I/O.
+ *
+ * Programs run per request (no -w, or plain CGI) are started with
+ * posix_spawn, which does not copy Tiny's page tables the way fork
+ * does, and are not waited for: the caller closes its copy of the
+ * connection and goes back to serving while the program runs. Their
+ * pids are kept in a list, and a reaper thread sitting in sigwait()
+ * for SIGCHLD, which every other thread blocks, collects them. It only
+ * waits for pids on that list, so workers stay with cgi_retire().
+ */
+#include "csapp.h"
+#include "cgipool.h"
+#include <spawn.h>
+
+typedef struct cgi_worker
+{
+  pid_t pid;
+  int fd;                  /* our end of the worker's socket */
+  int served;              /* requests answered so far */
+  struct cgi_worker *next; /* idle list */
+} cgi_worker_t;
+
+typedef struct
+{
+  char path[MAXLINE];
+  int plain;             /* never replies: run per request */
+  int nlive;             /* workers running, idle or not */
+  cgi_worker_t *idle;
+  pthread_cond_t cond;   /* an idle worker appeared, or one exited */
+} cgi_pool_t;
+
+static cgi_pool_t pools[CGIPOOL_MAX_PROGRAMS];
+static int npools;
+static int max_workers;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pid_t *children; /* one-shot programs not yet reaped */
+static int nchildren, maxchildren;
+static pthread_mutex_t children_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static cgi_pool_t *cgi_find(const char *path);
+static pid_t cgi_launch(const char *path, int sockfd, int connfd, const char *cgiargs);
+static cgi_worker_t *cgi_spawn(const char *path, int connfd, const char *cgiargs);
+static int cgi_send(cgi_worker_t *w, int connfd, const char *cgiargs);
+static int cgi_retire(cgi_worker_t *w);
+static void *cgi_reaper(void *vargp);
+
+/* ---------- public interface ---------- */
+/*
+ * cgipool_init - call before creating any other thread, so that they
+ *     all inherit SIGCHLD blocked and leave it to the reaper.
+ */
+void cgipool_init(int nworkers)
+{
+  sigset_t mask;
+  pthread_t tid;
+
+  max_workers = nworkers;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  pthread_sigmask(SIG_BLOCK, &mask, NULL);
+  Pthread_create(&tid, NULL, cgi_reaper, NULL);
+  Pthread_detach(tid);
+}
+
+/*
+ * cgipool_run - have a worker for path answer the request on connfd.
+ *     Returns 0 once the request has been handled (or its worker died
+ *     trying), and -1 if it never reached a worker, in which case the
+ *     caller should fork the program as usual.
+ */
+int cgipool_run(const char *path, int connfd, const char *cgiargs)
+{
+  cgi_pool_t *p;
+  cgi_worker_t *w;
+  char c;
+  int n, status;
+
+  if (max_workers == 0)
+    return -1;
+  pthread_mutex_lock(&lock);
+  if ((p = cgi_find(path)) == NULL || p->plain)
+  {
+    pthread_mutex_unlock(&lock);
+    return -1;
+  }
+  while (1)
+  {
+    if ((w = p->idle) != NULL)
+    {
+      p->idle = w->next;
+      pthread_mutex_unlock(&lock);
+      if (cgi_send(w, connfd, cgiargs) == 0)
+        break;
+      cgi_retire(w); /* exited while idle; try the next one */
+      pthread_mutex_lock(&lock);
+      p->nlive--;
+      continue;
+    }
+    if (p->nlive < max_workers)
+    {
+      p->nlive++;
+      pthread_mutex_unlock(&lock);
+      if ((w = cgi_spawn(path, connfd, cgiargs)) != NULL)
+        break;
+      pthread_mutex_lock(&lock);
+      p->nlive--;
+      pthread_cond_signal(&p->cond);
+      pthread_mutex_unlock(&lock);
+      return -1;
+    }
+    pthread_cond_wait(&p->cond, &lock);
+  }
+
+  /* the worker has the request; wait for it to finish */
+  while ((n = recv(w->fd, &c, 1, 0)) < 0 && errno == EINTR)
+    ;
+  if (n == 1)
+  {
+    w->served++;
+    pthread_mutex_lock(&lock);
+    w->next = p->idle;
+    p->idle = w;
+  }
+  else
+  {
+    /* gone: a plain CGI program, or a worker that crashed */
+    int first = w->served == 0;
+
+    status = cgi_retire(w);
+    pthread_mutex_lock(&lock);
+    p->nlive--;
+    if (first && WIFEXITED(status) && !p->plain)
+    {
+      fprintf(stderr, "cgipool: %s is not a worker, running it once per request\n", path);
+      p->plain = 1;
+    }
+  }
+  pthread_cond_signal(&p->cond);
+  pthread_mutex_unlock(&lock);
+  return 0;
+}
+
+/*
+ * cgipool_spawn - run path once for the request on connfd without
+ *     waiting for it; the reaper collects it. Returns -1 if it could
+ *     not be started.
+ */
+int cgipool_spawn(const char *path, int connfd, const char *cgiargs)
+{
+  pid_t pid;
+
+  /* held across the spawn so the reaper cannot miss a quick exit */
+  pthread_mutex_lock(&children_lock);
+  if ((pid = cgi_launch(path, -1, connfd, cgiargs)) < 0)
+  {
+    pthread_mutex_unlock(&children_lock);
+    return -1;
+  }
+  if (nchildren == maxchildren)
+  {
+    maxchildren = maxchildren ? 2 * maxchildren : 16;
+    children = Realloc(children, maxchildren * sizeof(pid_t));
+  }
+  children[nchildren++] = pid;
+  pthread_mutex_unlock(&children_lock);
+  return 0;
+}
+
+/* ---------- helpers ---------- */
+/* the pool for path, added on first use; NULL if the table is full (lock held) */
+static cgi_pool_t *cgi_find(const char *path)
+{
+  int i;
+
+  for (i = 0; i < npools; i++)
+    if (!strcmp(pools[i].path, path))
+      return &pools[i];
+  if (npools == CGIPOOL_MAX_PROGRAMS || strlen(path) >= MAXLINE)
+    return NULL;
+  strcpy(pools[npools].path, path);
+  pthread_cond_init(&pools[npools].cond, NULL);
+  return &pools[npools++];
+}
+
+/*
+ * cgi_launch - posix_spawn path with the request in place: QUERY_STRING
+ *     set and stdout on the client, plus stdin on sockfd for a worker
+ *     (sockfd >= 0). Tiny's own descriptors are close-on-exec, so the
+ *     child gets nothing else. Returns the pid, or -1.
+ */
+static pid_t cgi_launch(const char *path, int sockfd, int connfd, const char *cgiargs)
+{
+  char *argv[2], **envp, *qs;
+  posix_spawn_file_actions_t fa;
+  posix_spawnattr_t attr;
+  sigset_t mask;
+  int i, n, rc;
+  pid_t pid;
+
+  /* the environment is built here, not in the child; other threads may be running */
+  for (n = 0; environ[n]; n++)
+    ;
+  envp = Malloc((n + 3) * sizeof(char *));
+  for (i = n = 0; environ[i]; i++)
+    if (strncmp(environ[i], "QUERY_STRING=", 13) &&
+        strncmp(environ[i], CGIPOOL_WORKER_ENV "=", sizeof(CGIPOOL_WORKER_ENV)))
+      envp[n++] = environ[i];
+  qs = Malloc(strlen(cgiargs) + 14);
+  sprintf(qs, "QUERY_STRING=%s", cgiargs);
+  envp[n++] = qs;
+  if (sockfd >= 0)
+    envp[n++] = CGIPOOL_WORKER_ENV "=1";
+  envp[n] = NULL;
+  argv[0] = (char *)path;
+  argv[1] = NULL;
+
+  posix_spawn_file_actions_init(&fa);
+  if (sockfd >= 0)
+    posix_spawn_file_actions_adddup2(&fa, sockfd, STDIN_FILENO);
+  posix_spawn_file_actions_adddup2(&fa, connfd, STDOUT_FILENO);
+
+  /* undo what Tiny changed for itself: SIGCHLD blocked, SIGPIPE ignored */
+  posix_spawnattr_init(&attr);
+  sigemptyset(&mask);
+  posix_spawnattr_setsigmask(&attr, &mask);
+  sigaddset(&mask, SIGPIPE);
+  posix_spawnattr_setsigdefault(&attr, &mask);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+  rc = posix_spawn(&pid, path, &fa, &attr, argv, envp);
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&fa);
+  Free(qs);
+  Free(envp);
+  if (rc != 0)
+  {
+    fprintf(stderr, "cgipool: cannot run %s: %s\n", path, strerror(rc));
+    return -1;
+  }
+  return pid;
+}
+
+/*
+ * cgi_spawn - start a worker for path, handing it this request the way
+ *     a one-shot CGI child gets it. Returns NULL if it cannot be started.
+ */
+static cgi_worker_t *cgi_spawn(const char *path, int connfd, const char *cgiargs)
+{
+  cgi_worker_t *w;
+  int sv[2];
+  pid_t pid;
+
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+    return NULL;
+  pid = cgi_launch(path, sv[1], connfd, cgiargs);
+  close(sv[1]);
+  if (pid < 0)
+  {
+    close(sv[0]);
+    return NULL;
+  }
+
+  w = Malloc(sizeof(cgi_worker_t));
+  w->pid = pid;
+  w->fd = sv[0];
+  w->served = 0;
+  w->next = NULL;
+  return w;
+}
+
+/* pass a request to an idle worker; -1 if it is no longer there */
+static int cgi_send(cgi_worker_t *w, int connfd, const char *cgiargs)
+{
+  char env[CGIPOOL_MAX_REQUEST], cbuf[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct iovec iov;
+  int len;
+
+  len = snprintf(env, sizeof(env), "QUERY_STRING=%s", cgiargs) + 1;
+  if (len > (int)sizeof(env))
+    len = sizeof(env); /* truncated, still NUL-terminated */
+
+  memset(&msg, 0, sizeof(msg));
+  memset(cbuf, 0, sizeof(cbuf));
+  iov.iov_base = env;
+  iov.iov_len = len;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &connfd, sizeof(int));
+
+  while (sendmsg(w->fd, &msg, MSG_NOSIGNAL) < 0)
+    if (errno != EINTR)
+      return -1;
+  return 0;
+}
+
+/* close a worker's socket and reap it; returns its wait status */
+static int cgi_retire(cgi_worker_t *w)
+{
+  int status = 0;
+
+  close(w->fd); /* a live worker sees EOF and exits */
+  while (waitpid(w->pid, &status, 0) < 0 && errno == EINTR)
+    ;
+  Free(w);
+  return status;
+}
+
+/* collect one-shot children as SIGCHLD reports them */
+static void *cgi_reaper(void *vargp)
+{
+  sigset_t mask;
+  int i, sig;
+
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  while (1)
+  {
+    sigwait(&mask, &sig); /* signals merge: check every child each time */
+    pthread_mutex_lock(&children_lock);
+    for (i = 0; i < nchildren;)
+    {
+      if (waitpid(children[i], NULL, WNOHANG) != 0) /* exited, or not ours */
+        children[i] = children[--nchildren];
+      else
+        i++;
+    }
+    pthread_mutex_unlock(&children_lock);
+  }
+  return NULL;
+}
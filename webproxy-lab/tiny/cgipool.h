@@ -0,0 +1,15 @@
+/* cgipool.h - CGI processes: persistent worker pools and one-shot children */
+#ifndef __CGIPOOL_H__
+#define __CGIPOOL_H__
+
+#define CGIPOOL_MAX_PROGRAMS 16 /* programs with a pool; others run per request */
+#define CGIPOOL_MAX_REQUEST 8192 /* largest request message (environment block) */
+
+/* environment variable that tells a program it was started as a worker */
+#define CGIPOOL_WORKER_ENV "TINY_CGI_WORKER"
+
+void cgipool_init(int nworkers); /* at most nworkers processes per program */
+int cgipool_run(const char *path, int connfd, const char *cgiargs);
+int cgipool_spawn(const char *path, int connfd, const char *cgiargs);
+
+#endif /* __CGIPOOL_H__ */
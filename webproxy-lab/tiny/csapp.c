@@ -1,6 +1,17 @@
 /* 
  * csapp.c - Functions for the CS:APP3e book
  *
+ * Updated for Tiny:
+ *   - rio_readlineb copies whole spans found with memchr rather than
+ *     reading one byte at a time
+ *   - Added rio_writev, Rio_writev and the rio_iov_t gather list, so
+ *     headers and bodies go out in one writev without being copied
+ *     together first
+ *   - open_listenfd creates its socket close-on-exec
+ *   - gai_error is renamed to csapp_gai_error (see csapp.h) so that
+ *     _GNU_SOURCE code can include this header
+ *   - Added hash_str32 for Tiny's hash tables
+ *
  * Updated 10/2016 reb:
  *   - Fixed bug in sio_ltoa that didn't cover negative numbers
  *
@@ -792,6 +803,77 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 }
 /* $end rio_writen */
 
+/*
+ * rio_writev - Robustly write a gather list (unbuffered), resuming
+ *     after partial writes. The iovec array is used up in the process.
+ */
+/* $begin rio_writev */
+ssize_t rio_writev(int fd, struct iovec *iov, int iovcnt) 
+{
+    size_t n = 0;
+    ssize_t nwritten;
+    int i;
+
+    for (i = 0; i < iovcnt; i++)
+	n += iov[i].iov_len;
+    while (1) {
+	while (iovcnt > 0 && iov->iov_len == 0) { /* Skip finished pieces */
+	    iov++;
+	    iovcnt--;
+	}
+	if (iovcnt <= 0)
+	    break;
+	if ((nwritten = writev(fd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX)) < 0) {
+	    if (errno == EINTR)  /* Interrupted by sig handler return */
+		nwritten = 0;    /* and call writev() again */
+	    else
+		return -1;       /* errno set by writev() */
+	}
+	else if (nwritten == 0) { /* No progress on a nonempty list: give up */
+	    errno = EIO;
+	    return -1;
+	}
+	for (; iovcnt > 0 && (size_t)nwritten >= iov->iov_len; iov++, iovcnt--)
+	    nwritten -= iov->iov_len;
+	if (nwritten > 0) {      /* Partly written piece */
+	    iov->iov_base = (char *)iov->iov_base + nwritten;
+	    iov->iov_len -= nwritten;
+	}
+    }
+    return n;
+}
+/* $end rio_writev */
+
+/*
+ * rio_iovinit - Start an empty gather list
+ */
+void rio_iovinit(rio_iov_t *vp) 
+{
+    vp->iov_cnt = 0;
+    vp->iov_len = 0;
+}
+
+/*
+ * rio_iovadd - Append n bytes at p, which must stay put until the list
+ *     is written. Returns -1 if the list is full.
+ */
+int rio_iovadd(rio_iov_t *vp, const void *p, size_t n) 
+{
+    if (n == 0)
+	return 0;
+    if (vp->iov_cnt == RIO_IOVMAX)
+	return -1;
+    vp->iov[vp->iov_cnt].iov_base = (void *)p;
+    vp->iov[vp->iov_cnt++].iov_len = n;
+    vp->iov_len += n;
+    return 0;
+}
+
+int rio_iovputs(rio_iov_t *vp, const char *s) 
+{
+    return rio_iovadd(vp, s, strlen(s));
+}
+
 
 /* 
  * rio_read - This is a wrapper for the Unix read() function that
@@ -866,30 +948,44 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 
 /* 
  * rio_readlineb - Robustly read a text line (buffered)
+ *    Scans the internal buffer with memchr() and copies whole spans
+ *    up to the newline, instead of one rio_read() call per byte.
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) { 
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-	    *bufp++ = c;
-	    if (c == '\n') {
-                n++;
-     		break;
-            }
-	} else if (rc == 0) {
-	    if (n == 1)
-		return 0; /* EOF, no data read */
-	    else
-		break;    /* EOF, some data was read */
-	} else
-	    return -1;	  /* Error */
+    size_t n = 0, cnt;
+    ssize_t rc;
+    char *bufp = usrbuf, *nl;
+
+    while (n + 1 < maxlen) {
+        if (rp->rio_cnt <= 0) { /* Refill; rio_read hands back the first byte */
+	    if ((rc = rio_read(rp, bufp, 1)) < 0)
+		return -1;    /* Error */
+	    else if (rc == 0)
+		break;        /* EOF */
+	    n++;
+	    if (*bufp++ == '\n')
+		break;
+	    continue;
+	}
+
+	/* Copy the buffered bytes up to and including the newline */
+	cnt = maxlen - 1 - n;
+	if ((size_t)rp->rio_cnt < cnt)
+	    cnt = rp->rio_cnt;
+	if ((nl = memchr(rp->rio_bufptr, '\n', cnt)) != NULL)
+	    cnt = nl - rp->rio_bufptr + 1;
+	memcpy(bufp, rp->rio_bufptr, cnt);
+	rp->rio_bufptr += cnt;
+	rp->rio_cnt -= cnt;
+	bufp += cnt;
+	n += cnt;
+	if (nl)
+	    break;
     }
     *bufp = 0;
-    return n-1;
+    return n;     /* 0 only at EOF with no data read */
 }
 /* $end rio_readlineb */
 
@@ -911,6 +1007,12 @@ void Rio_writen(int fd, void *usrbuf, size_t n)
 	unix_error("Rio_writen error");
 }
 
+void Rio_writev(int fd, struct iovec *iov, int iovcnt) 
+{
+    if (rio_writev(fd, iov, iovcnt) < 0)
+	unix_error("Rio_writev error");
+}
+
 void Rio_readinitb(rio_t *rp, int fd)
 {
     rio_readinitb(rp, fd);
@@ -1012,7 +1114,8 @@ int open_listenfd(char *port)
     /* Walk the list for one that we can bind to */
     for (p = listp; p; p = p->ai_next) {
         /* Create a socket descriptor */
-        if ((listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) 
+        /* close-on-exec from the start: CGI programs never inherit it */
+        if ((listenfd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol)) < 0) 
             continue;  /* Socket failed, try the next */
 
         /* Eliminates "Address already in use" error from bind */
@@ -1064,6 +1167,21 @@ int Open_listenfd(char *port)
     return rc;
 }
 
+/****************************************
+ * Hashing helpers
+ ****************************************/
+/* FNV-1a, 32-bit */
+unsigned hash_str32(const char *s) 
+{
+    unsigned h = 2166136261u;
+
+    while (*s) {
+	h ^= (unsigned char)*s++;
+	h *= 16777619u;
+    }
+    return h;
+}
+
 /* $end csapp.c */
 
 
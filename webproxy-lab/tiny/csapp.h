@@ -24,6 +24,8 @@
 #include <math.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <limits.h>
+#include <sys/uio.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <netinet/in.h>
@@ -51,6 +53,17 @@ typedef struct {
 } rio_t;
 /* $end rio_t */
 
+/* Gather list for rio_writev: pieces are referenced, not copied */
+#define RIO_IOVMAX 16
+#ifndef IOV_MAX
+#define IOV_MAX 1024 /* Most iovecs one writev() takes (Linux) */
+#endif
+typedef struct {
+    int iov_cnt;                  /* Pieces in iov */
+    size_t iov_len;               /* Bytes in all pieces */
+    struct iovec iov[RIO_IOVMAX];
+} rio_iov_t;
+
 /* External variables */
 extern int h_errno;    /* Defined by BIND for DNS errors */ 
 extern char **environ; /* Defined by libc */
@@ -61,6 +74,8 @@ extern char **environ; /* Defined by libc */
 #define LISTENQ  1024  /* Second argument to listen() */
 
 /* Our own error-handling functions */
+/* glibc's <netdb.h> declares its own gai_error() under _GNU_SOURCE */
+#define gai_error csapp_gai_error
 void unix_error(char *msg);
 void posix_error(int code, char *msg);
 void dns_error(char *msg);
@@ -175,6 +190,10 @@ void V(sem_t *sem);
 /* Rio (Robust I/O) package */
 ssize_t rio_readn(int fd, void *usrbuf, size_t n);
 ssize_t rio_writen(int fd, void *usrbuf, size_t n);
+ssize_t rio_writev(int fd, struct iovec *iov, int iovcnt);
+void rio_iovinit(rio_iov_t *vp);
+int rio_iovadd(rio_iov_t *vp, const void *p, size_t n);
+int rio_iovputs(rio_iov_t *vp, const char *s);
 void rio_readinitb(rio_t *rp, int fd); 
 ssize_t	rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
@@ -182,6 +201,7 @@ ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 /* Wrappers for Rio package */
 ssize_t Rio_readn(int fd, void *usrbuf, size_t n);
 void Rio_writen(int fd, void *usrbuf, size_t n);
+void Rio_writev(int fd, struct iovec *iov, int iovcnt);
 void Rio_readinitb(rio_t *rp, int fd); 
 ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
@@ -194,6 +214,9 @@ int open_listenfd(char *port);
 int Open_clientfd(char *hostname, char *port);
 int Open_listenfd(char *port);
 
+/* Hashing helpers */
+unsigned hash_str32(const char *s);
+
 
 #endif /* __CSAPP_H__ */
 /* $end csapp.h */
@@ -0,0 +1,185 @@
+/*
+ * fcache.c - cache of open files and rendered headers for static responses
+ *
+ * A hit turns a static request into stat() (which doit does anyway),
+ * one header write and one sendfile(): the descriptor stays open and
+ * the header, content type included, is rendered once. An entry is
+ * valid while the path still names the same file, i.e. the stat()
+ * result matches its device, inode, size and mtime; otherwise it is
+ * replaced. At most FCACHE_MAX_ENTRIES files are kept, least recently
+ * used going first.
+ *
+ * Entries are reference counted, so one replaced or evicted while
+ * another thread is still sending from it is closed by its last user.
+ * Senders pass their own offsets to sendfile(), which leaves the shared
+ * file position alone.
+ */
+#include "csapp.h"
+#include "fcache.h"
+
+#define FCACHE_BUCKETS 512
+
+static fcache_entry_t *table[FCACHE_BUCKETS];
+static fcache_entry_t *head, *tail; /* most / least recently used */
+static int count;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int fcache_valid(const fcache_entry_t *e, const struct stat *st);
+static fcache_entry_t *fcache_open(const char *path, fcache_render_t render);
+static void fcache_link(fcache_entry_t *e);
+static void fcache_unlink(fcache_entry_t *e);
+static void fcache_lru_push(fcache_entry_t *e);
+static void fcache_lru_remove(fcache_entry_t *e);
+static void fcache_free(fcache_entry_t *e);
+
+/*
+ * fcache_get - return a referenced entry for path, which doit has just
+ *     stat()ed into st, opening the file on a miss. Returns NULL if the
+ *     file cannot be opened.
+ */
+fcache_entry_t *fcache_get(const char *path, const struct stat *st, fcache_render_t render)
+{
+  fcache_entry_t *e;
+
+  pthread_mutex_lock(&lock);
+  for (e = table[hash_str32(path) % FCACHE_BUCKETS]; e; e = e->hnext)
+    if (!strcmp(e->path, path))
+      break;
+  if (e && fcache_valid(e, st))
+  {
+    e->refcnt++;
+    fcache_lru_remove(e); /* move to the front */
+    fcache_lru_push(e);
+    pthread_mutex_unlock(&lock);
+    return e;
+  }
+  pthread_mutex_unlock(&lock);
+
+  /* miss or stale: open and render without the lock */
+  if ((e = fcache_open(path, render)) == NULL)
+    return NULL;
+
+  pthread_mutex_lock(&lock);
+  fcache_link(e); /* also retires an older entry for the same path */
+  while (count > FCACHE_MAX_ENTRIES)
+    fcache_unlink(tail);
+  pthread_mutex_unlock(&lock);
+  return e;
+}
+
+void fcache_release(fcache_entry_t *e)
+{
+  int left;
+
+  pthread_mutex_lock(&lock);
+  left = --e->refcnt;
+  pthread_mutex_unlock(&lock);
+  if (left == 0)
+    fcache_free(e);
+}
+
+/* ---------- helpers ---------- */
+/* does the file at the path still look like the one we hold open? */
+static int fcache_valid(const fcache_entry_t *e, const struct stat *st)
+{
+  return e->dev == st->st_dev && e->ino == st->st_ino && e->size == st->st_size &&
+         e->mtime.tv_sec == st->st_mtim.tv_sec && e->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/* open path and describe it from fstat, so the header matches the open file */
+static fcache_entry_t *fcache_open(const char *path, fcache_render_t render)
+{
+  char buf[MAXBUF];
+  struct stat st;
+  fcache_entry_t *e;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) /* CGI children must not inherit it */
+    return NULL;
+  if (fstat(fd, &st) < 0)
+  {
+    close(fd);
+    return NULL;
+  }
+
+  e = Calloc(1, sizeof(fcache_entry_t));
+  e->fd = fd;
+  e->size = st.st_size;
+  e->hdr_len = render(buf, path, st.st_size);
+  e->hdr = Malloc(e->hdr_len);
+  memcpy(e->hdr, buf, e->hdr_len);
+  e->path = Malloc(strlen(path) + 1);
+  strcpy(e->path, path);
+  e->dev = st.st_dev;
+  e->ino = st.st_ino;
+  e->mtime = st.st_mtim;
+  e->refcnt = 2; /* the table's and the caller's */
+  return e;
+}
+
+/* insert e at the front, replacing any entry with the same path (lock held) */
+static void fcache_link(fcache_entry_t *e)
+{
+  fcache_entry_t **pp = &table[hash_str32(e->path) % FCACHE_BUCKETS];
+
+  while (*pp)
+  {
+    if (*pp != e && !strcmp((*pp)->path, e->path))
+    {
+      fcache_unlink(*pp);
+      break;
+    }
+    pp = &(*pp)->hnext;
+  }
+
+  e->hnext = table[hash_str32(e->path) % FCACHE_BUCKETS];
+  table[hash_str32(e->path) % FCACHE_BUCKETS] = e;
+  fcache_lru_push(e);
+  count++;
+}
+
+/* remove e from the table and drop the table's reference (lock held) */
+static void fcache_unlink(fcache_entry_t *e)
+{
+  fcache_entry_t **pp = &table[hash_str32(e->path) % FCACHE_BUCKETS];
+
+  while (*pp != e)
+    pp = &(*pp)->hnext;
+  *pp = e->hnext;
+  fcache_lru_remove(e);
+  count--;
+
+  if (--e->refcnt == 0)
+    fcache_free(e);
+}
+
+static void fcache_lru_push(fcache_entry_t *e)
+{
+  e->prev = NULL;
+  e->next = head;
+  if (head)
+    head->prev = e;
+  head = e;
+  if (tail == NULL)
+    tail = e;
+}
+
+static void fcache_lru_remove(fcache_entry_t *e)
+{
+  if (e->prev)
+    e->prev->next = e->next;
+  else
+    head = e->next;
+  if (e->next)
+    e->next->prev = e->prev;
+  else
+    tail = e->prev;
+}
+
+static void fcache_free(fcache_entry_t *e)
+{
+  close(e->fd);
+  Free(e->hdr);
+  Free(e->path);
+  Free(e);
+}
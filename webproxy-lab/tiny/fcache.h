@@ -0,0 +1,34 @@
+/* fcache.h - cache of open files and rendered headers for static responses */
+#ifndef __FCACHE_H__
+#define __FCACHE_H__
+
+#include "csapp.h"
+
+#define FCACHE_MAX_ENTRIES 256 /* cached files (each holds a descriptor) */
+
+typedef struct fcache_entry fcache_entry_t;
+
+/* renders the response header for path into buf (MAXBUF); returns its length */
+typedef int (*fcache_render_t)(char *buf, const char *path, off_t size);
+
+/* callers read these; the rest is private to fcache.c */
+struct fcache_entry
+{
+  int fd;        /* open, close-on-exec; read with offsets only */
+  off_t size;
+  char *hdr;     /* complete response header */
+  int hdr_len;
+  /* private */
+  char *path;
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  int refcnt;
+  struct fcache_entry *prev, *next; /* LRU list */
+  struct fcache_entry *hnext;       /* hash chain */
+};
+
+fcache_entry_t *fcache_get(const char *path, const struct stat *st, fcache_render_t render);
+void fcache_release(fcache_entry_t *e);
+
+#endif /* __FCACHE_H__ */
@@ -1,16 +1,41 @@
 /* $begin tinymain */
 /*
- * tiny.c - A simple, iterative HTTP/1.0 Web server that uses the
- *     GET method to serve static and dynamic content.
+ * tiny.c - A simple HTTP/1.0 Web server that uses the GET method to
+ *     serve static and dynamic content.
+ *
+ *     usage: tiny [-t threads] [-f processes] [-w cgi_workers] <port>
+ *
+ *     Iterative by default. -t serves connections from a pool of
+ *     worker threads fed through an sbuf (CS:APP Fig. 12.28), and -f
+ *     pre-forks that many processes sharing the listening socket, each
+ *     running its own accept loop (and pool, with -t). -w keeps up to
+ *     that many persistent processes per CGI program (cgipool.c)
+ *     instead of spawning one per request. Either way Tiny does not
+ *     wait for CGI programs; cgipool.c reaps them.
  *
  * Updated from CS:APP3e (Fig. 11.29~11.33)
  */
+#define _GNU_SOURCE /* accept4 */
 #include "csapp.h"
+#include "sbuf.h"
+#include "fcache.h"
+#include "cgipool.h"
+#include <sys/sendfile.h>
+
+#define SBUFSIZE 64 /* accepted connections waiting for a worker */
 
+static sbuf_t sbuf;
+
+void serve(int listenfd, int nthreads);
+void prefork(int nprocs);
+void *worker(void *vargp);
 void doit(int fd);
 void read_requesthdrs(rio_t *rp);
 int parse_uri(char *uri, char *filename, char *cgiargs);
-void serve_static(int fd, char *filename, int filesize);
+void serve_static(int fd, char *filename, struct stat *sbuf);
+int static_header(char *buf, const char *filename, off_t filesize);
+int send_more(int fd, const char *buf, int n);
+int sendfile_all(int fd, int srcfd, int filesize);
 void get_filetype(char *filename, char *filetype);
 void serve_dynamic(int fd, char *filename, char *cgiargs);
 void clienterror(int fd, char *cause, char *errnum, char *shortmsg,
@@ -18,28 +43,112 @@ void clienterror(int fd, char *cause, char *errnum, char *shortmsg,
 
 int main(int argc, char **argv)
 {
-  int listenfd, connfd;
+  int listenfd, opt, nthreads = 0, nprocs = 0, ncgi = 0;
+
+  while ((opt = getopt(argc, argv, "t:f:w:")) != -1)
+  {
+    if (opt == 't')
+      nthreads = atoi(optarg);
+    else if (opt == 'f')
+      nprocs = atoi(optarg);
+    else if (opt == 'w')
+      ncgi = atoi(optarg);
+    else
+      optind = argc; /* force the usage message below */
+  }
+  if (optind != argc - 1 || nthreads < 0 || nprocs < 0 || ncgi < 0)
+  {
+    fprintf(stderr, "usage: %s [-t threads] [-f processes] [-w cgi_workers] <port>\n", argv[0]);
+    exit(1);
+  }
+
+  Signal(SIGPIPE, SIG_IGN); /* a client that hangs up must not kill the server */
+  listenfd = Open_listenfd(argv[optind]); /* close-on-exec: kept out of CGI programs */
+  if (nprocs > 0)
+    prefork(nprocs); /* returns only in the children */
+  cgipool_init(ncgi); /* starts the reaper: after prefork, before the pool */
+  serve(listenfd, nthreads);
+}
+
+/* serve - accept loop: hand connections to nthreads workers, or serve them inline */
+void serve(int listenfd, int nthreads)
+{
+  int i, connfd;
   char hostname[MAXLINE], port[MAXLINE];
   socklen_t clientlen;
   struct sockaddr_storage clientaddr;
+  pthread_t tid;
 
-  if (argc != 2)
+  if (nthreads > 0)
   {
-    fprintf(stderr, "usage: %s <port>\n", argv[0]);
-    exit(1);
+    sbuf_init(&sbuf, SBUFSIZE);
+    for (i = 0; i < nthreads; i++)
+      Pthread_create(&tid, NULL, worker, NULL);
   }
 
-  listenfd = Open_listenfd(argv[1]);
   while (1)
   {
     clientlen = sizeof(clientaddr);
-    connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
+    /*
+     * close-on-exec from the moment it exists, so a CGI program another
+     * worker spawns meanwhile cannot inherit it; CGI programs get it
+     * only as stdout
+     */
+    if ((connfd = accept4(listenfd, (SA *)&clientaddr, &clientlen, SOCK_CLOEXEC)) < 0)
+      unix_error("Accept error");
     Getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE,
                 port, MAXLINE, 0);
     printf("Accepted connection from (%s, %s)\n", hostname, port);
+    if (nthreads > 0)
+    {
+      sbuf_insert(&sbuf, connfd);
+      continue;
+    }
+    doit(connfd);
+    Close(connfd);
+  }
+}
+
+/*
+ * prefork - start nprocs children that return to run the accept loop.
+ *     The parent stays behind and replaces any child that dies.
+ */
+void prefork(int nprocs)
+{
+  int i;
+  pid_t pid;
+
+  for (i = 0; i < nprocs; i++)
+    if (Fork() == 0)
+      return;
+
+  while (1)
+  {
+    if ((pid = wait(NULL)) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      unix_error("prefork: wait error");
+    }
+    fprintf(stderr, "prefork: process %d exited, restarting it\n", (int)pid);
+    if (Fork() == 0)
+      return;
+  }
+}
+
+/* worker - serve connections from the shared buffer, one at a time */
+void *worker(void *vargp)
+{
+  int connfd;
+
+  Pthread_detach(pthread_self());
+  while (1)
+  {
+    connfd = sbuf_remove(&sbuf);
     doit(connfd);
     Close(connfd);
   }
+  return NULL;
 }
 
 /* ------------------------
@@ -50,23 +159,25 @@ int main(int argc, char **argv)
 void clienterror(int fd, char *cause, char *errnum,
                  char *shortmsg, char *longmsg)
 {
-  char buf[MAXLINE], body[MAXBUF];
-
-  /* Build the HTTP response body */
-  sprintf(body, "<html><title>Tiny Error</title>");
-  sprintf(body, "%s<body bgcolor=\"ffffff\">\r\n", body);
-  sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-  sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-  sprintf(body, "%s<hr><em>The Tiny Web server</em>\r\n", body);
-
-  /* Print the HTTP response */
-  sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-  Rio_writen(fd, buf, strlen(buf));
-  sprintf(buf, "Content-type: text/html\r\n");
-  Rio_writen(fd, buf, strlen(buf));
-  sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-  Rio_writen(fd, buf, strlen(buf));
-  Rio_writen(fd, body, strlen(body));
+  char buf[MAXLINE];
+  char *body[] = {"<html><title>Tiny Error</title><body bgcolor=\"ffffff\">\r\n",
+                  errnum, ": ", shortmsg, "\r\n<p>", longmsg, ": ", cause,
+                  "\r\n<hr><em>The Tiny Web server</em>\r\n"};
+  int i, nbody = sizeof(body) / sizeof(body[0]), body_len = 0;
+  rio_iov_t out;
+
+  /* The HTTP response body is sent piece by piece, never assembled */
+  for (i = 0; i < nbody; i++)
+    body_len += strlen(body[i]);
+  snprintf(buf, sizeof(buf), "HTTP/1.0 %s %s\r\nContent-type: text/html\r\nContent-length: %d\r\n\r\n",
+           errnum, shortmsg, body_len);
+
+  /* Print the HTTP response in one writev */
+  rio_iovinit(&out);
+  rio_iovputs(&out, buf);
+  for (i = 0; i < nbody; i++)
+    rio_iovputs(&out, body[i]);
+  rio_writev(fd, out.iov, out.iov_cnt); /* the client may have hung up */
 }
 
 /* doit - handle one HTTP request/response transaction */
@@ -84,7 +195,7 @@ void clienterror(int fd, char *cause, char *errnum,
  * 사용 예시:
  *  - 정적 요청:
  *      GET /home.html HTTP/1.1
- *      → serve_static(fd, "./home.html", filesize)
+ *      → serve_static(fd, "./home.html", &sbuf)
  *  - 동적 요청:
  *      GET /cgi-bin/adder?arg1=10&arg2=20 HTTP/1.1
  *      → serve_dynamic(fd, "./cgi-bin/adder", "arg1=10&arg2=20")
@@ -135,7 +246,7 @@ void doit(int fd)
       return;
     }
 
-    serve_static(fd, filename, sbuf.st_size);
+    serve_static(fd, filename, &sbuf);
   }
   else
   {
@@ -155,9 +266,9 @@ void read_requesthdrs(rio_t *rp)
 {
   char buf[MAXLINE];
 
-  Rio_readlineb(rp, buf, MAXLINE);
-  while (strcmp(buf, "\r\n"))
-    Rio_readlineb(rp, buf, MAXLINE);
+  /* stop at the empty line, or if the client hangs up before sending it */
+  while (rio_readlineb(rp, buf, MAXLINE) > 0 && strcmp(buf, "\r\n"))
+    ;
   return;
 }
 
@@ -193,27 +304,100 @@ int parse_uri(char *uri, char *filename, char *cgiargs)
   }
 }
 
-/* serve_static - send static content to the client */
-void serve_static(int fd, char *filename, int filesize)
+/*
+ * serve_static - send static content to the client. The open file and
+ *     its rendered header come from fcache, revalidated against sbuf.
+ */
+void serve_static(int fd, char *filename, struct stat *sbuf)
+{
+  fcache_entry_t *e;
+  char *srcp;
+
+  if ((e = fcache_get(filename, sbuf, static_header)) == NULL)
+  {
+    clienterror(fd, filename, "403", "Forbidden", "Tiny 서버가 파일을 읽을 수 없습니다");
+    return;
+  }
+
+  /*
+   * Send response headers to client; MSG_MORE holds them back to leave
+   * in the same segment as the start of the body
+   */
+  if (send_more(fd, e->hdr, e->hdr_len) < 0)
+  {
+    fcache_release(e);
+    return;
+  }
+
+  /* Send response body to client: kernel to socket if we can, else via mmap */
+  if (sendfile_all(fd, e->fd, e->size) < 0)
+  {
+    srcp = Mmap(0, e->size, PROT_READ, MAP_PRIVATE, e->fd, 0);
+    rio_writen(fd, srcp, e->size); /* the client may have hung up */
+    Munmap(srcp, e->size);
+  }
+  fcache_release(e);
+}
+
+/* static_header - render the response header for a static file into buf */
+int static_header(char *buf, const char *filename, off_t filesize)
+{
+  char filetype[MAXLINE];
+
+  get_filetype((char *)filename, filetype);
+  return sprintf(buf,
+                 "HTTP/1.0 200 OK\r\n"
+                 "Server: Tiny Web Server\r\n"
+                 "Connection: close\r\n"
+                 "Content-length: %d\r\n"
+                 "Content-type: %s\r\n\r\n",
+                 (int)filesize, filetype);
+}
+
+/*
+ * send_more - rio_writen with MSG_MORE: send all n bytes, resuming
+ *     after partial sends and EINTR. Returns -1 if the client went away.
+ */
+int send_more(int fd, const char *buf, int n)
+{
+  ssize_t nsent;
+
+  while (n > 0)
+  {
+    if ((nsent = send(fd, buf, n, MSG_MORE)) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    buf += nsent;
+    n -= nsent;
+  }
+  return 0;
+}
+
+/*
+ * sendfile_all - send filesize bytes of srcfd to fd with sendfile(),
+ *     resuming after partial sends. Returns 0 when done or when the
+ *     client went away, and -1, having sent nothing, if sendfile()
+ *     cannot be used so the caller can fall back to mmap.
+ */
+int sendfile_all(int fd, int srcfd, int filesize)
 {
-  int srcfd;
-  char *srcp, filetype[MAXLINE], buf[MAXBUF];
-
-  /* Send response headers to client */
-  get_filetype(filename, filetype);
-  sprintf(buf, "HTTP/1.0 200 OK\r\n");
-  sprintf(buf + strlen(buf), "Server: Tiny Web Server\r\n");
-  sprintf(buf + strlen(buf), "Connection: close\r\n");
-  sprintf(buf + strlen(buf), "Content-length: %d\r\n", filesize);
-  sprintf(buf + strlen(buf), "Content-type: %s\r\n\r\n", filetype);
-  Rio_writen(fd, buf, strlen(buf));
-
-  /* Send response body to client */
-  srcfd = Open(filename, O_RDONLY, 0);
-  srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
-  Close(srcfd);
-  Rio_writen(fd, srcp, filesize);
-  Munmap(srcp, filesize);
+  off_t offset = 0;
+  ssize_t n;
+
+  while (offset < filesize)
+  {
+    n = sendfile(fd, srcfd, &offset, filesize - offset); /* advances offset */
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && offset == 0 && (errno == EINVAL || errno == ENOSYS))
+      return -1;
+    if (n <= 0) /* client error, or the file shrank under us */
+      break;
+  }
+  return 0;
 }
 
 /* get_filetype - derive file type from filename */
@@ -237,26 +421,24 @@ void get_filetype(char *filename, char *filetype)
     strcpy(filetype, "text/plain");
 }
 
-/* serve_dynamic - run a CGI program on behalf of the client */
+/*
+ * serve_dynamic - run a CGI program on behalf of the client, on one of
+ *     its persistent workers if -w allows, else in a spawned child
+ *     that holds the connection open until it exits, unwaited for
+ */
 void serve_dynamic(int fd, char *filename, char *cgiargs)
 {
-  char buf[MAXLINE], *emptylist[] = {NULL};
+  static char first[] = "HTTP/1.0 200 OK\r\nServer: Tiny Web Server\r\n";
 
-  /* Return first part of HTTP response */
-  sprintf(buf, "HTTP/1.0 200 OK\r\n");
-  Rio_writen(fd, buf, strlen(buf));
-  sprintf(buf, "Server: Tiny Web Server\r\n");
-  Rio_writen(fd, buf, strlen(buf));
+  /* Return first part of HTTP response; a client that hung up gets no CGI */
+  if (rio_writen(fd, first, sizeof(first) - 1) != sizeof(first) - 1)
+    return;
 
-  if (Fork() == 0)
-  { /* Child process */
-    setenv("QUERY_STRING", cgiargs, 1);
+  if (cgipool_run(filename, fd, cgiargs) == 0)
+    return;
 
-    Dup2(fd, STDOUT_FILENO);
-    /* Redirect stdout to client */
-    Execve(filename, emptylist, environ); /* Run CGI program */
-  }
-  Wait(NULL); /* Parent waits for child */
+  /* the child gets its own copy of fd as stdout; the caller closes ours */
+  cgipool_spawn(filename, fd, cgiargs);
 }
 
 /* $end tinymain */
@@ -0,0 +1,220 @@
+/*
+ * upstream.c - pool of idle keep-alive connections to origin servers
+ *
+ * After a response has been read to its exact end, the worker parks
+ * the origin socket here under its host:port instead of closing it, and
+ * the next miss for that origin skips the DNS lookup and the TCP
+ * handshake. Each origin keeps at most UPSTREAM_MAX_IDLE_PER_HOST
+ * sockets, most recently used first. A reaper thread closes sockets
+ * that sit idle longer than UPSTREAM_IDLE_TIMEOUT, and a socket the
+ * origin has closed in the meantime is detected (and discarded) when
+ * it is taken out of the pool.
+ *
+ * New connections resolve through the DNS cache in dns.c and race the
+ * origin's addresses under a deadline (open_clientfd_ai). Every origin
+ * socket, pooled or not, gets a receive timeout, so an origin that
+ * stalls mid-response costs the worker UPSTREAM_READ_TIMEOUT seconds
+ * rather than the worker itself.
+ *
+ * Origins with no idle sockets have no entry, so the table only holds
+ * what is actually reusable. One lock covers the table; it is held
+ * only for list surgery, never across I/O.
+ */
+#include "csapp.h"
+#include "upstream.h"
+#include "dns.h"
+#include <time.h>
+
+#define UPSTREAM_BUCKETS 256
+#define UPSTREAM_REAP_SEC 1 /* reaper period */
+
+typedef struct upstream_host
+{
+  char *key;                                  /* "host:port" */
+  int fds[UPSTREAM_MAX_IDLE_PER_HOST];        /* parked sockets, oldest first */
+  time_t since[UPSTREAM_MAX_IDLE_PER_HOST];   /* when each was parked */
+  int nidle;
+  struct upstream_host *next;                 /* bucket chain */
+} upstream_host_t;
+
+static upstream_host_t *table[UPSTREAM_BUCKETS];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int connect_timeout; /* ms allowed for a new connection */
+
+static void upstream_key(char *key, const char *host, const char *port);
+static upstream_host_t **upstream_find(const char *key);
+static void upstream_drop_at(upstream_host_t *h, int i);
+static int upstream_alive(int fd);
+static void *upstream_reaper(void *vargp);
+
+/* ---------- public interface ---------- */
+void upstream_init(int connect_ms)
+{
+  pthread_t tid;
+
+  connect_timeout = connect_ms;
+  Pthread_create(&tid, NULL, upstream_reaper, NULL);
+  Pthread_detach(tid);
+}
+
+/*
+ * Return a connected socket to host:port, reusing a parked one when
+ * possible. *reused_ptr tells the caller whether the socket came from
+ * the pool, since an origin may still close a reused socket just as
+ * the request goes out. Returns -1 if a new connection fails.
+ */
+int upstream_connect(const char *host, const char *port, int *reused_ptr)
+{
+  char key[MAXLINE];
+  upstream_host_t **pp, *h;
+  struct timeval tv;
+  int fd;
+
+  upstream_key(key, host, port);
+  while (1)
+  {
+    pthread_mutex_lock(&lock);
+    pp = upstream_find(key);
+    if ((h = *pp) == NULL)
+    {
+      pthread_mutex_unlock(&lock);
+      break;
+    }
+    fd = h->fds[--h->nidle]; /* most recently parked */
+    if (h->nidle == 0)
+    {
+      *pp = h->next;
+      Free(h->key);
+      Free(h);
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (upstream_alive(fd))
+    {
+      *reused_ptr = 1;
+      return fd;
+    }
+    close(fd);
+  }
+
+  *reused_ptr = 0;
+  if ((fd = dns_open_clientfd(host, port, connect_timeout)) < 0)
+    return -1;
+
+  /* parked sockets keep this, so it is set once per connection */
+  tv.tv_sec = UPSTREAM_READ_TIMEOUT;
+  tv.tv_usec = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  return fd;
+}
+
+/* park fd for reuse; the caller must have read the last response completely */
+void upstream_release(const char *host, const char *port, int fd)
+{
+  char key[MAXLINE];
+  upstream_host_t **pp, *h;
+  int victim = -1;
+
+  upstream_key(key, host, port);
+  pthread_mutex_lock(&lock);
+  pp = upstream_find(key);
+  if ((h = *pp) == NULL)
+  {
+    h = Calloc(1, sizeof(upstream_host_t));
+    h->key = Malloc(strlen(key) + 1);
+    strcpy(h->key, key);
+    *pp = h;
+  }
+  if (h->nidle == UPSTREAM_MAX_IDLE_PER_HOST)
+  {
+    victim = h->fds[0]; /* full: retire the oldest */
+    upstream_drop_at(h, 0);
+  }
+  h->fds[h->nidle] = fd;
+  h->since[h->nidle] = mono_sec();
+  h->nidle++;
+  pthread_mutex_unlock(&lock);
+
+  if (victim >= 0)
+    close(victim);
+}
+
+/* ---------- helpers ---------- */
+static void upstream_key(char *key, const char *host, const char *port)
+{
+  snprintf(key, MAXLINE, "%s:%s", host, port);
+}
+
+/* link that points at key's entry, or at the NULL ending its chain (lock held) */
+static upstream_host_t **upstream_find(const char *key)
+{
+  upstream_host_t **pp = &table[hash_str32(key) % UPSTREAM_BUCKETS];
+
+  while (*pp && strcmp((*pp)->key, key))
+    pp = &(*pp)->next;
+  return pp;
+}
+
+/* remove slot i, keeping the rest oldest first (lock held) */
+static void upstream_drop_at(upstream_host_t *h, int i)
+{
+  memmove(&h->fds[i], &h->fds[i + 1], (h->nidle - i - 1) * sizeof(int));
+  memmove(&h->since[i], &h->since[i + 1], (h->nidle - i - 1) * sizeof(time_t));
+  h->nidle--;
+}
+
+/*
+ * An idle keep-alive socket must have nothing to read: EOF means the
+ * origin closed it, and stray bytes mean we lost track of framing.
+ */
+static int upstream_alive(int fd)
+{
+  char c;
+  ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+  return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/* close sockets parked longer than UPSTREAM_IDLE_TIMEOUT */
+static void *upstream_reaper(void *vargp)
+{
+  upstream_host_t **pp, *h;
+  int b, i, n, stale[64];
+  time_t now;
+
+  while (1)
+  {
+    sleep(UPSTREAM_REAP_SEC);
+    now = mono_sec();
+    n = 0;
+
+    pthread_mutex_lock(&lock);
+    for (b = 0; b < UPSTREAM_BUCKETS; b++)
+    {
+      pp = &table[b];
+      while ((h = *pp) != NULL)
+      {
+        /* oldest first, so expired sockets form a prefix */
+        while (h->nidle > 0 && n < 64 && now - h->since[0] >= UPSTREAM_IDLE_TIMEOUT)
+        {
+          stale[n++] = h->fds[0];
+          upstream_drop_at(h, 0);
+        }
+        if (h->nidle == 0)
+        {
+          *pp = h->next;
+          Free(h->key);
+          Free(h);
+        }
+        else
+          pp = &h->next;
+      }
+    }
+    pthread_mutex_unlock(&lock);
+
+    /* leftovers past 64 go on the next pass */
+    for (i = 0; i < n; i++)
+      close(stale[i]);
+  }
+  return NULL;
+}
@@ -0,0 +1,13 @@
+/* upstream.h - pool of idle keep-alive connections to origin servers */
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#define UPSTREAM_MAX_IDLE_PER_HOST 8 /* parked sockets kept per host:port */
+#define UPSTREAM_IDLE_TIMEOUT 15     /* seconds an idle socket may be parked */
+#define UPSTREAM_READ_TIMEOUT 30     /* seconds an origin may go silent mid-response */
+
+void upstream_init(int connect_ms); /* starts the idle reaper */
+int upstream_connect(const char *host, const char *port, int *reused_ptr);
+void upstream_release(const char *host, const char *port, int fd);
+
+#endif /* __UPSTREAM_H__ */